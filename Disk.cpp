@@ -5,33 +5,97 @@
 // provides methods to read and write raw sectors, mount and umount DSK format
 // files and other low-level functions.
 //
-// Note that there is no caching here.  Writes immediately get written to the
-// disk, and reads are always read directly from the disk.  This might be
-// optimized a bit by delaying writes and doing them during idle polls, but
-// I'll leave that to someone else.
+// Writes go into a small per-drive write-back cache and are ACKed as soon as
+// the data is in RAM.  The dirty sectors get written to the DSK file as one
+// batch, when the drive's flush mode says so, or right away when the drive is
+// unmounted or closed.  Reads check the cache first so the host always sees
+// the latest data.
+//
+// Reads go through a small 2Q read cache.  Reads are also watched for
+// sequential or fixed-stride patterns.  Once a pattern is spotted, the next
+// few sectors are read into the cache between host commands so the next
+// request can be answered from RAM.  Optionally,
+// the FLEX forward link at the start of each sector is used to prefetch the
+// next sector of the file, wherever it happens to be.
+//
+// A drive can also keep the first part of its image, or all of it, in RAM.
+// Those sectors are read and written with no SD access at all, and written
+// ones go back to the card along with the rest of the batch.
+//
+// An overlay mount leaves the DSK file alone and keeps the host's writes in a
+// separate .OVL file, which can be merged back in or thrown away later.  A
+// sparse image uses the same container on its own, and only stores sectors
+// that aren't all one value.
 //
 // Bob Applegate, K2UT - bob@corshamtech.com
 
 #include <SD.h>
 #include "Disk.h"
 #include "Errors.h"
+#include "SdFuncs.h"
 
 extern void hexdump(unsigned char *, unsigned int);
+extern unsigned getSectorSize(byte code);
+extern int freeMemory(void);
+
+
+
+static bool writeIntent(byte slot, const char *name);
+static bool checkIntent(byte slot, const char *name);
+
+// The write-intent file, shared by all the drives and kept open once used.
+
+static File intentFile;
 
+// The read cache, shared by all the drives.  See Disk.h.
 
+static cacheEntry_t readCache[READ_CACHE_SECTORS];
+static ghostEntry_t ghost[READ_CACHE_GHOSTS];
+static byte ghostNext;                  // oldest ghost, replaced next
+static word tick;                       // for the entry stamps
 
 // Define to dump sectors
 
 #undef DUMP_SECTORS
 
+// Define to print how long each sector read from the card takes, in
+// microseconds.
+
+#undef TIME_SECTOR_IO
+
 
 //=============================================================================
 // This creates an instance of the Disk but does not do any initialization.
+// drive is the drive number, which picks this drive's write-intent record.
 
-Disk::Disk(void)
+Disk::Disk(byte drive)
 {
+        driveNumber = drive;
+        intentMarked = false;
+        lastFlush = 0;
         mountedFlag = false;
         isOpenF = false;;
+        writeBackFailed = false;
+        flushMode = DEFAULT_FLUSH_MODE;
+        batchInterrupted = false;
+        invalidateCache();
+        resetReadCache();
+        readCount = readAheadHits = readAheadFetches = 0;
+        cacheHits = cacheMisses = 0;
+        pinSystem = false;
+        linkPrefetch = false;
+        sectorsPerTrack = 0;
+        linkFetches = 0;
+        imageSize = 0;
+        filePos = POSITION_UNKNOWN;
+        seekCount = seeksAvoided = 0;
+        sectorSize = DEFAULT_SECTOR_SIZE;
+        sectorSizeCode = DEFAULT_SECTOR_CODE;
+        imageType = IMAGE_RAW;
+        hostBytesWritten = cardBlocksWritten = fillReads = 0;
+        ramImage = ramDirty = NULL;
+        ramSectors = 0;
+        ramPending = false;
 }
 
 
@@ -57,7 +121,49 @@ void Disk::unmount(void)
 {
         if (mountedFlag)  // no sense unmounting if not mounted
         {
+                flush();    // get any cached writes onto the card
+                clearIntent();
+                invalidateCache();
+                resetReadCache();
+                releaseRam();
                 file.close();
+                if (imageType != IMAGE_RAW)
+                {
+                        overlay.close();
+                        imageType = IMAGE_RAW;
+                }
+
+                Serial.print(filename);
+                Serial.print(" reads: ");
+                Serial.print(readCount);
+                Serial.print(", cache hits: ");
+                Serial.print(cacheHits);
+                Serial.print(", misses: ");
+                Serial.print(cacheMisses);
+                Serial.print(", read-ahead hits: ");
+                Serial.print(readAheadHits);
+                Serial.print(", prefetched: ");
+                Serial.print(readAheadFetches);
+                Serial.print(", link prefetched: ");
+                Serial.print(linkFetches);
+                Serial.print(", seeks: ");
+                Serial.print(seekCount);
+                Serial.print(", seeks avoided: ");
+                Serial.println(seeksAvoided);
+                Serial.print("   bytes written: ");
+                Serial.print(hostBytesWritten);
+                Serial.print(", card blocks written: ");
+                Serial.print(cardBlocksWritten);
+                Serial.print(", fill reads: ");
+                Serial.print(fillReads);
+                if (hostBytesWritten != 0)
+                {
+                        Serial.print(", write amplification: ");
+                        Serial.print((cardBlocksWritten * CARD_BLOCK_SIZE * 100) / hostBytesWritten);
+                        Serial.print("%");
+                }
+                Serial.println();
+
                 isOpenF = false;;
                 setError(ERR_NOT_MOUNTED);
                 mountedFlag = false;
@@ -68,20 +174,42 @@ void Disk::unmount(void)
 
 
 //=============================================================================
-// Given a pathname to a file, attempt to open it.  Returns true if mounted,
-// false if not and the error flag is set with the reason.
+// Given a pathname to a file, attempt to open it.  The sector size code says
+// how big the sectors in the image are.  If useOverlay is set (and it isn't
+// read-only), the file is a base image and writes go to an overlay file.  A
+// sparse image is recognized by its header, which also gives the sector size,
+// and can't have an overlay.
+// Returns true if mounted, false if not and the error flag is set with the
+// reason.
 
-bool Disk::mount(char *afilename, bool readOnly)
+bool Disk::mount(char *afilename, bool readOnly, byte sizeCode, bool useOverlay)
 {
+        // If something is already mounted, get rid of it first so any cached
+        // writes go to the old file and not the new one.
+
+        unmount();
+
         goodFlag = false;    // assume it is not good
+        writeBackFailed = false;
+        batchInterrupted = false;
+        flushMode = DEFAULT_FLUSH_MODE;     // caller changes it if wanted
         //byte buffer[SECTOR_SIZE];
         
         Serial.print("Disk::Disk ");
         Serial.println(afilename);
+
+        // The sector size has to be one this build can handle.
+        
+        if (sizeCode < 1 || sizeCode > 4 || ::getSectorSize(sizeCode) > MAX_SECTOR_SIZE)
+        {
+                Serial.print("Unsupported sector size code ");
+                Serial.println(sizeCode);
+                setError(ERR_BAD_SECTOR);
+        }
       
         // Make sure the file exists!
         
-        if (SD.exists(afilename))
+        else if (SD.exists(afilename))
         {
                 // Set the right open flag depending on whether it's read-only
                 // or not.
@@ -91,6 +219,11 @@ bool Disk::mount(char *afilename, bool readOnly)
                         openFlag = FILE_READ;
                         Serial.println("opening read only");
                 }
+                else if (useOverlay)
+                {
+                        openFlag = FILE_READ;
+                        Serial.println("opening as overlay base");
+                }
                 else
                 {
                         openFlag = O_RDWR;
@@ -111,14 +244,63 @@ bool Disk::mount(char *afilename, bool readOnly)
                         goodFlag = true;
                         mountedFlag = true;
                         isOpenF = true;
+                        resetReadCache();
+                        readCount = readAheadHits = readAheadFetches = 0;
+                        cacheHits = cacheMisses = 0;
+                        pinSystem = false;      // caller turns it on if wanted
+                        linkPrefetch = false;   // caller turns it on if wanted
+                        sectorsPerTrack = 0;
+                        linkFetches = 0;
+                        imageSize = file.size();
+                        filePos = 0;            // freshly opened
+                        seekCount = seeksAvoided = 0;
+                        sectorSizeCode = sizeCode;
+                        sectorSize = ::getSectorSize(sizeCode);
+                        hostBytesWritten = cardBlocksWritten = fillReads = 0;
+
+                        // A sparse image is opened as a container instead.
+                        
+                        overlayHeader_t header;
+                        if (readBlock(file, (byte *)&header, sizeof(header)) == sizeof(header) &&
+                            header.magic == SPARSE_MAGIC)
+                        {
+                                file.close();
+                                if (!openSparse(afilename, &header, readOnly))
+                                {
+                                        mountedFlag = false;
+                                        isOpenF = false;
+                                }
+                        }
+                        filePos = POSITION_UNKNOWN;
+                        batchInterrupted = checkIntent(driveNumber, afilename);
+                        if (batchInterrupted)
+                        {
+                                Serial.println("WARNING: last write batch to this image was interrupted");
+                        }
                 
                         strcpy(filename, afilename);    // save name for later
+
+                        if (useOverlay && !readOnly && imageType == IMAGE_RAW && goodFlag)
+                        {
+                                if (openOverlay())
+                                {
+                                        imageType = IMAGE_OVERLAY;
+                                }
+                                else
+                                {
+                                        file.close();
+                                        mountedFlag = false;
+                                        isOpenF = false;
+                                        setError(ERR_READ_ERROR);
+                                }
+                        }
                 }
         }
         else
         {
                 setError(ERR_FILE_NOT_FOUND);
         }
+        return goodFlag;
 }
 
 
@@ -129,7 +311,16 @@ bool Disk::mount(char *afilename, bool readOnly)
 
 void Disk::close(void)
 {
+        flush();
+        clearIntent();
+        invalidateCache();
+        resetReadCache();
+        releaseRam();
         file.close();
+        if (imageType != IMAGE_RAW)
+        {
+                overlay.close();
+        }
         isOpenF = false;
 }
 
@@ -139,7 +330,7 @@ void Disk::close(void)
 //=============================================================================
 // Reads a sector of data.  On entry this is given the offset into the DSK
 // file and a pointer to where to place the data.  This always reads exactly
-// SECTOR_SIZE bytes.
+// one sector, which is sectorSize bytes.
 //
 // Returns true on success, false on error
 
@@ -157,23 +348,51 @@ bool Disk::read(unsigned long offset, byte *buf)
         byte *orig = buf;
 #endif
 
-        file.seek(offset);
-        
-        if ((file.available() < SECTOR_SIZE) || (offset + SECTOR_SIZE > file.size()))
+        // If the sector is in RAM or the write cache then that copy is the
+        // most recent one, so use it.  Next best is the read cache, and if
+        // it isn't there either then go to the card and remember it.  Note
+        // the read cache is checked before the read pattern is updated,
+        // since a break in the pattern forgets what was read ahead.
+
+        byte *cached = findCached(offset);
+        cacheEntry_t *entry;
+        if (cached != NULL)
         {
-                Serial.print("Not enough bytes: ");
-                Serial.println(file.available());
-                ret = false;
-                errorCode = ERR_READ_ERROR;
+                memcpy(buf, cached, sectorSize);
+                cacheHits++;
+        }
+        else if ((entry = findReadCached(offset)) != NULL)
+        {
+                memcpy(buf, entry->data, sectorSize);
+                if (entry->prefetched)
+                {
+                        entry->prefetched = false;
+                        readAheadHits++;
+                }
+                if (entry->queue == RC_MAIN)
+                {
+                        entry->stamp = ++tick;  // most recently used
+                }
+                cacheHits++;
+        }
+        else
+        {
+                cacheMisses++;
+                ret = readFromFile(offset, buf);
+                if (ret)
+                {
+                        cacheSector(offset, buf);
+                }
         }
-        for (int i = 0; i < SECTOR_SIZE; i++)
+        trackReadPattern(offset);
+
+        if (ret && linkPrefetch)
         {
-                *buf = file.read();
-                buf++;
+                followLink(offset, buf);
         }
         
 #ifdef DUMP_SECTORS
-        hexdump(orig, SECTOR_SIZE);
+        hexdump(orig, sectorSize);
 #endif
         return ret;
 }
@@ -184,8 +403,9 @@ bool Disk::read(unsigned long offset, byte *buf)
 //=============================================================================
 // This writes a single sector to the specified offset.  On entry, this is 
 // given the long offset (must be a multiple of the sector size) and a pointer
-// to exactly one sector's worth of data.  Does the write, then rReturns true
-// on success or false on error.
+// to exactly one sector's worth of data.  The data goes into the write-back
+// cache and gets written to the card later.  Returns true on success or false
+// on error.
 
 bool Disk::write(unsigned long offset, byte *buf)
 {
@@ -200,47 +420,98 @@ bool Disk::write(unsigned long offset, byte *buf)
         {
                 errorCode = ERR_READ_ONLY;
         }
-        else
+        else if (offset + sectorSize > imageSize)
         {
-                if (file.seek(offset) == false)
-                {
-                        Serial.print("Failed seeing to offset ");
-                        Serial.println(offset);
-                }
-                if (file.available() < SECTOR_SIZE)
+                Serial.print("Write past end of file at offset ");
+                Serial.println(offset);
+                errorCode = ERR_WRITE_ERROR;
+        }
+        else if (inRam(offset))
+        {
+                // RAM-resident sectors are just marked dirty; the next flush
+                // takes them to the card.
+                
+                memcpy(ramImage + offset, buf, sectorSize);
+                if (!ramPending)
                 {
-                        Serial.print("Not enough bytes: ");
-                        Serial.println(file.available());
-                        errorCode = ERR_WRITE_ERROR;
+                        ramDirtyTime = millis();
+                        ramPending = true;
                 }
-                else
+                ramDirty[offset / sectorSize / 8] |= 1 << ((offset / sectorSize) % 8);
+                hostBytesWritten += sectorSize;
+                ret = (flushMode == FLUSH_SECTOR) ? flush() : true;
+        }
+        else
+        {
+                // If the line holding the sector is already cached then just
+                // update it.  Else grab a clean line, and if they're all
+                // dirty then write out the batch to make room.
+                
+                cacheLine_t *line = findLine(offset);
+                if (line == NULL)
                 {
-                        // Write the data and then flush it to be sure the
-                        // data gets written.
+                        cacheLine_t *oldest = NULL;
                         
-                        int wrote = file.write(buf, SECTOR_SIZE);
-                        file.flush();
-                   
-                        if (wrote != SECTOR_SIZE)
+                        for (int i = 0; i < WRITE_CACHE_LINES && line == NULL; i++)
                         {
-                                Serial.print("Didn't write enough bytes: ");
-                                Serial.println(wrote);
-                                errorCode = ERR_WRITE_ERROR;
+                                if (!cache[i].dirtyMask)
+                                {
+                                        line = &cache[i];
+                                }
+                                else if (oldest == NULL || (long)(cache[i].dirtyTime - oldest->dirtyTime) < 0)
+                                {
+                                        oldest = &cache[i];
+                                }
                         }
-                        else
+                        
+                        // Cache is full of dirty sectors, so write the whole
+                        // batch out and reuse the oldest line.
+                        
+                        if (line == NULL)
                         {
-                                ret = true;    // success!
-#if 0
-                                Serial.print("Just wrote ");
-                                Serial.print(wrote);
-                                Serial.print(" bytes at offset ");
-                                Serial.println(offset);
-#endif
-#ifdef DUMP_SECTORS
-                                hexdump(buf, SECTOR_SIZE);
-#endif
+                                if (!flush())
+                                {
+                                        return ret;     // errorCode already set
+                                }
+                                line = oldest;
                         }
+                        line->offset = offset - offset % CACHE_LINE_SIZE;
+                        line->validMask = 0;
+                }
+                
+                // Keep any read cache copy of this sector up to date.
+
+                cacheEntry_t *copy = findReadCached(offset);
+                if (copy != NULL)
+                {
+                        memcpy(copy->data, buf, sectorSize);
+                }
+
+                memcpy(line->data + (offset - line->offset), buf, sectorSize);
+                if (!line->dirtyMask)
+                {
+                        line->dirtyTime = millis();
+                }
+                line->validMask |= sectorBit(offset);
+                line->dirtyMask |= sectorBit(offset);
+                hostBytesWritten += sectorSize;
+                ret = true;    // success!
+
+                // Depending on the flush mode, this might be the time to
+                // commit the batch.  In FLUSH_SECTOR mode the host has to
+                // hear about a failure.
+                
+                if (flushMode == FLUSH_SECTOR)
+                {
+                        ret = flush();
+                }
+                else if (flushMode == FLUSH_TIMER && dirtyCount() >= WRITE_CACHE_LINES * (CACHE_LINE_SIZE / sectorSize))
+                {
+                        flush();
                 }
+#ifdef DUMP_SECTORS
+                hexdump(buf, sectorSize);
+#endif
         }
         return ret;
 }
@@ -255,11 +526,11 @@ bool Disk::write(unsigned long offset, byte *buf)
 //  0: 0 = disk not present, 1 = mounted
 //  1: 0 = read only, 1 = R/W
 //  2: 0 = sector readable, 1 = sector unreadable
-//  3: 
-//  4: 
-//  5: 
-//  6: 
-//  7: 
+//  3: 1 = a cached write failed when written to the SD card
+//  4: 1 = a batch of writes was interrupted before this image was mounted
+//  5: 1 = writes are going to an overlay file
+//  6: 1 = some or all of the image is held in RAM
+//  7: 1 = sparse image
 //
 // Generally speaking, a value of 0 means no problems.
 
@@ -275,7 +546,1584 @@ byte Disk::getStatus(void)
                 {
                         ret |= 0x02;
                 }
+
+                if (writeBackFailed)
+                {
+                        ret |= 0x08;
+                }
+
+                if (batchInterrupted)
+                {
+                        ret |= 0x10;
+                }
+
+                if (imageType == IMAGE_OVERLAY)
+                {
+                        ret |= 0x20;
+                }
+
+                if (ramSectors != 0)
+                {
+                        ret |= 0x40;
+                }
+
+                if (imageType == IMAGE_SPARSE)
+                {
+                        ret |= 0x80;
+                }
         }
                 
         return ret;
 }
+
+
+
+
+//=============================================================================
+// Writes every dirty sector in the cache and in the RAM-resident part of the
+// image to the DSK file, then flushes the file so the FAT and directory entry
+// are updated once for the whole batch.  Runs of dirty RAM sectors go out
+// with one write each.
+// A batch of more than one sector marks the write-intent record first, if it
+// isn't already marked; the idle poll clears it later.
+// Returns true on success, false if any sector could not be written.
+
+bool Disk::flush(void)
+{
+        bool ret = true;
+        bool wrote = false;
+
+        if (dirtyCount() > 1)
+        {
+                markIntent();
+        }
+
+        for (int i = 0; i < WRITE_CACHE_LINES; i++)
+        {
+                if (cache[i].dirtyMask)
+                {
+                        if (!writeLine(&cache[i]))
+                        {
+                                ret = false;
+                        }
+                        wrote = true;
+                }
+        }
+
+        for (unsigned i = 0; i < ramSectors; i++)
+        {
+                if (ramDirty[i / 8] & (1 << (i % 8)))
+                {
+                        unsigned run = 1;
+                        
+                        while (i + run < ramSectors && (ramDirty[(i + run) / 8] & (1 << ((i + run) % 8))))
+                        {
+                                run++;
+                        }
+                        if (!writeRun((unsigned long)i * sectorSize, ramImage + (unsigned long)i * sectorSize, run * sectorSize))
+                        {
+                                writeBackFailed = true;
+                                ret = false;
+                        }
+                        for (unsigned j = i; j < i + run; j++)
+                        {
+                                ramDirty[j / 8] &= ~(1 << (j % 8));
+                        }
+                        i += run - 1;
+                        wrote = true;
+                }
+        }
+        ramPending = false;
+
+        if (wrote)
+        {
+                if (imageType != IMAGE_RAW)
+                {
+                        overlay.flush();
+                }
+                else
+                {
+                        file.flush();
+                }
+        }
+        lastFlush = millis();
+        return ret;
+}
+
+
+
+
+//=============================================================================
+// Called from the idle polls.  Clears the write-intent record once nothing
+// has been written for INTENT_CLEAR_DELAY ms.  In FLUSH_TIMER mode, once any
+// dirty sector has been sitting in the cache for at least WRITE_BACK_DELAY ms
+// the batch gets written out.  Sectors the host keeps rewriting will still
+// get written at least that often.
+
+void Disk::poll(void)
+{
+        if (!mountedFlag || !isOpenF)
+        {
+                return;
+        }
+
+        if (intentMarked && !isDirty() && millis() - lastFlush >= INTENT_CLEAR_DELAY)
+        {
+                clearIntent();
+        }
+
+        if (flushMode != FLUSH_TIMER)
+        {
+                return;
+        }
+
+        for (int i = 0; i < WRITE_CACHE_LINES; i++)
+        {
+                if (cache[i].dirtyMask && millis() - cache[i].dirtyTime >= WRITE_BACK_DELAY)
+                {
+                        flush();    // might as well write them all at once
+                        return;
+                }
+        }
+        
+        if (ramPending && millis() - ramDirtyTime >= WRITE_BACK_DELAY)
+        {
+                flush();
+        }
+}
+
+
+
+
+//=============================================================================
+// Returns true if there is data in the cache that hasn't been written yet.
+
+bool Disk::isDirty(void)
+{
+        for (int i = 0; i < WRITE_CACHE_LINES; i++)
+        {
+                if (cache[i].dirtyMask)
+                {
+                        return true;
+                }
+        }
+        for (unsigned i = 0; i < (ramSectors + 7) / 8; i++)
+        {
+                if (ramDirty[i])
+                {
+                        return true;
+                }
+        }
+        return false;
+}
+
+
+
+
+//=============================================================================
+// Returns the number of sectors in the cache and in RAM waiting to be
+// written.
+
+unsigned Disk::dirtyCount(void)
+{
+        unsigned count = 0;
+        
+        for (int i = 0; i < WRITE_CACHE_LINES; i++)
+        {
+                for (byte mask = cache[i].dirtyMask; mask != 0; mask >>= 1)
+                {
+                        count += (mask & 1);
+                }
+        }
+        for (unsigned i = 0; i < (ramSectors + 7) / 8; i++)
+        {
+                for (byte mask = ramDirty[i]; mask != 0; mask >>= 1)
+                {
+                        count += (mask & 1);
+                }
+        }
+        return count;
+}
+
+
+
+
+//=============================================================================
+// Given a file offset, return a pointer to the cached copy of that sector,
+// or NULL if it isn't cached.  RAM-resident sectors count as cached.
+
+byte *Disk::findCached(unsigned long offset)
+{
+        if (inRam(offset))
+        {
+                return ramImage + offset;
+        }
+        
+        cacheLine_t *line = findLine(offset);
+        
+        if (line != NULL && (line->validMask & sectorBit(offset)))
+        {
+                return line->data + (offset - line->offset);
+        }
+        return NULL;
+}
+
+
+
+
+//=============================================================================
+// Given a file offset, return a pointer to the cache line covering it, or
+// NULL if there isn't one.
+
+cacheLine_t *Disk::findLine(unsigned long offset)
+{
+        unsigned long lineOffset = offset - offset % CACHE_LINE_SIZE;
+        
+        for (int i = 0; i < WRITE_CACHE_LINES; i++)
+        {
+                if (cache[i].validMask && cache[i].offset == lineOffset)
+                {
+                        return &cache[i];
+                }
+        }
+        return NULL;
+}
+
+
+
+
+//=============================================================================
+// Writes one dirty cache line to the DSK file.  Any sectors of the line that
+// aren't in the cache are read in first so the line can go out as whole card
+// blocks; the card would have had to read them anyway.  If one of those reads
+// fails, or this is an overlay or sparse image, only the dirty sectors are
+// written.  The line never goes past the end of the image, and it stays in
+// the cache as a clean copy.  The caller is
+// responsible for flushing the file.  Returns true on success, false on
+// error.  Since the host already got an ACK for this data, a failure is
+// remembered and reported in the drive status.
+
+bool Disk::writeLine(cacheLine_t *line)
+{
+        bool ret = true;
+        unsigned length = CACHE_LINE_SIZE;
+        byte savedError = errorCode;
+        bool whole = (imageType == IMAGE_RAW);
+
+        if (line->offset + length > imageSize)
+        {
+                length = imageSize - line->offset;
+        }
+
+        for (unsigned pos = 0; whole && pos < length; pos += sectorSize)
+        {
+                byte bit = sectorBit(pos);
+                
+                if (!(line->validMask & bit))
+                {
+                        cacheEntry_t *copy = findReadCached(line->offset + pos);
+                        if (copy != NULL)
+                        {
+                                memcpy(line->data + pos, copy->data, sectorSize);
+                                line->validMask |= bit;
+                        }
+                        else if (readFromFile(line->offset + pos, line->data + pos))
+                        {
+                                line->validMask |= bit;
+                                fillReads++;
+                        }
+                        else
+                        {
+                                whole = false;
+                        }
+                }
+        }
+        errorCode = savedError;     // a failed fill isn't the host's problem
+
+        if (whole)
+        {
+                ret = writeRun(line->offset, line->data, length);
+        }
+        else
+        {
+                for (unsigned pos = 0; pos < length; pos += sectorSize)
+                {
+                        if ((line->dirtyMask & sectorBit(pos)) &&
+                            !writeRun(line->offset + pos, line->data + pos, sectorSize))
+                        {
+                                ret = false;
+                        }
+                }
+        }
+
+        // Either way the line is no longer dirty.  If the write failed,
+        // retrying forever won't help.
+        
+        line->dirtyMask = 0;
+        return ret;
+}
+
+
+
+
+//=============================================================================
+// Writes length bytes at the given offset in the DSK file, and counts the
+// card blocks that get programmed.  Returns true on success, false on error.
+
+bool Disk::writeRun(unsigned long offset, byte *buf, unsigned length)
+{
+        bool ret = false;
+
+        cardBlocksWritten += (offset + length - 1) / CARD_BLOCK_SIZE - offset / CARD_BLOCK_SIZE + 1;
+
+        if (imageType != IMAGE_RAW)
+        {
+                ret = true;
+                for (unsigned pos = 0; pos < length; pos += sectorSize)
+                {
+                        if (!overlayWrite(offset + pos, buf + pos))
+                        {
+                                Serial.print("Didn't write overlay sector at offset ");
+                                Serial.println(offset + pos);
+                                errorCode = ERR_WRITE_ERROR;
+                                writeBackFailed = true;
+                                ret = false;
+                        }
+                }
+                return ret;
+        }
+
+        if (seekTo(offset) == false)
+        {
+                Serial.print("Failed seeing to offset ");
+                Serial.println(offset);
+        }
+        
+        if (!writeBlock(file, buf, length))
+        {
+                Serial.print("Didn't write sector at offset ");
+                Serial.println(offset);
+                errorCode = ERR_WRITE_ERROR;
+                writeBackFailed = true;
+                filePos = POSITION_UNKNOWN;
+        }
+        else
+        {
+                filePos += length;
+                ret = true;
+        }
+        return ret;
+}
+
+
+
+
+//=============================================================================
+// Reads one sector straight from the DSK file.  Returns true on success or
+// false on error, with errorCode set.
+
+bool Disk::readFromFile(unsigned long offset, byte *buf)
+{
+        bool ret = true;
+        word chunk = 0;
+        word page;
+#ifdef TIME_SECTOR_IO
+        unsigned long start = micros();
+#endif
+        
+        if (offset + sectorSize > imageSize)
+        {
+                Serial.print("Read past end of file at offset ");
+                Serial.println(offset);
+                ret = false;
+                errorCode = ERR_READ_ERROR;
+        }
+        else if (imageType != IMAGE_RAW && !overlayFind(offset / sectorSize, &chunk, &page))
+        {
+                Serial.println("Overlay index read failed");
+                ret = false;
+                errorCode = ERR_READ_ERROR;
+        }
+        else if (chunk & FILL_SECTOR)
+        {
+                memset(buf, chunk & 0xff, sectorSize);
+        }
+        else if (chunk != 0)
+        {
+                // The host has written this sector, so it's in the overlay.
+                
+                if (!overlay.seek((unsigned long)chunk * sectorSize) ||
+                    (unsigned)readBlock(overlay, buf, sectorSize) != sectorSize)
+                {
+                        Serial.println("Short overlay read");
+                        ret = false;
+                        errorCode = ERR_READ_ERROR;
+                }
+        }
+        else if (imageType == IMAGE_SPARSE)
+        {
+                memset(buf, sparseFill, sectorSize);    // never written
+        }
+        else if (!seekTo(offset) || (unsigned)readBlock(file, buf, sectorSize) != sectorSize)
+        {
+                Serial.println("Short sector read");
+                ret = false;
+                errorCode = ERR_READ_ERROR;
+                filePos = POSITION_UNKNOWN;
+        }
+        else
+        {
+                filePos += sectorSize;
+        }
+
+#ifdef TIME_SECTOR_IO
+        Serial.print("Sector read took ");
+        Serial.print(micros() - start);
+        Serial.println(" us");
+#endif
+        return ret;
+}
+
+
+
+
+//=============================================================================
+// Moves the file position to the given offset, but only calls the SD library
+// if it isn't already there.  Returns true on success.
+
+bool Disk::seekTo(unsigned long offset)
+{
+        if (filePos == offset)
+        {
+                seeksAvoided++;
+                return true;
+        }
+
+        seekCount++;
+        if (file.seek(offset))
+        {
+                filePos = offset;
+                return true;
+        }
+        filePos = POSITION_UNKNOWN;
+        return false;
+}
+
+
+
+
+//=============================================================================
+// Opens the overlay for the mounted base image, creating an empty one if
+// there isn't one yet.  Only the header is read, so this takes the same time
+// no matter how big the base is.  Returns true on success.
+
+bool Disk::openOverlay(void)
+{
+        char name[FNAME_SIZE + 1];
+        overlayHeader_t header;
+        
+        overlayName(name);
+        overlaySectors = imageSize / sectorSize;
+        perPage = sectorSize / 2;
+        
+        if (SD.exists(name))
+        {
+                overlay = SD.open(name, O_RDWR);
+                if (!overlay)
+                {
+                        Serial.println("Error opening overlay!");
+                        return false;
+                }
+                if (readBlock(overlay, (byte *)&header, sizeof(header)) != sizeof(header) ||
+                    header.magic != OVERLAY_MAGIC ||
+                    header.sectors != overlaySectors ||
+                    header.sectorSize != sectorSize)
+                {
+                        Serial.print(name);
+                        Serial.println(" doesn't belong to this image");
+                        overlay.close();
+                        return false;
+                }
+                nextChunk = overlay.size() / sectorSize;
+        }
+        else
+        {
+                overlay = SD.open(name, O_RDWR | O_CREAT);
+                if (!overlay)
+                {
+                        Serial.println("Error creating overlay!");
+                        return false;
+                }
+
+                // The header chunk, then the zeroed top-level table.
+                
+                unsigned long pages = (overlaySectors + perPage - 1) / perPage;
+                unsigned long tableChunks = (pages * 2 + sectorSize - 1) / sectorSize;
+                
+                header.magic = OVERLAY_MAGIC;
+                header.sectors = overlaySectors;
+                header.sectorSize = sectorSize;
+                header.fill = 0;
+                
+                nextChunk = 0;
+                for (unsigned long c = 0; c <= tableChunks; c++)
+                {
+                        word chunk;
+                        if (!overlayAppend(NULL, &chunk))
+                        {
+                                overlay.close();
+                                return false;
+                        }
+                }
+                overlay.seek(0);
+                writeBlock(overlay, (byte *)&header, sizeof(header));
+                overlay.flush();
+        }
+
+        Serial.print("Overlay ");
+        Serial.print(name);
+        Serial.print(", ");
+        Serial.print(nextChunk);
+        Serial.println(" chunks");
+        return true;
+}
+
+
+
+
+//=============================================================================
+// Opens the sparse image whose header has already been read.  The header,
+// not the mount request, decides the sector size.  Only the header is
+// needed; everything else is found through the index as sectors are used.
+// Returns true on success, else the error is set.
+
+bool Disk::openSparse(char *name, overlayHeader_t *header, bool readOnly)
+{
+        byte code = 1;
+        
+        while (code <= 4 && ::getSectorSize(code) != header->sectorSize)
+        {
+                code++;
+        }
+        if (code > 4 || header->sectorSize > MAX_SECTOR_SIZE)
+        {
+                Serial.print("Unsupported sparse sector size ");
+                Serial.println(header->sectorSize);
+                setError(ERR_BAD_SECTOR);
+                return false;
+        }
+        
+        overlay = SD.open(name, readOnly ? FILE_READ : O_RDWR);
+        if (!overlay)
+        {
+                Serial.println("Error opening sparse image!");
+                setError(ERR_READ_ERROR);
+                return false;
+        }
+        
+        imageType = IMAGE_SPARSE;
+        sectorSizeCode = code;
+        sectorSize = header->sectorSize;
+        overlaySectors = header->sectors;
+        imageSize = overlaySectors * sectorSize;
+        perPage = sectorSize / 2;
+        nextChunk = overlay.size() / sectorSize;
+        sparseFill = header->fill;
+
+        Serial.print("Sparse image, ");
+        Serial.print(overlaySectors);
+        Serial.print(" sectors in ");
+        Serial.print(nextChunk);
+        Serial.println(" chunks");
+        return true;
+}
+
+
+
+
+//=============================================================================
+// Builds the name of the overlay file for the mounted image: same name, but
+// with the OVERLAY_EXT extension.
+
+void Disk::overlayName(char *name)
+{
+        strcpy(name, filename);
+        char *dot = strchr(name, '.');
+        if (dot == NULL)
+        {
+                dot = name + strlen(name);
+        }
+        strcpy(dot, "." OVERLAY_EXT);
+}
+
+
+
+
+//=============================================================================
+// Looks up a base sector in the overlay index.  chunk is set to the chunk
+// holding its data, and page to the chunk holding its index page, either one
+// zero if there isn't one.  Returns false if the index couldn't be read.
+
+bool Disk::overlayFind(unsigned long sector, word *chunk, word *page)
+{
+        *chunk = 0;
+        if (!readWord(sectorSize + (sector / perPage) * 2, page))
+        {
+                return false;
+        }
+        if (*page == 0)
+        {
+                return true;
+        }
+        return readWord((unsigned long)*page * sectorSize + (sector % perPage) * 2, chunk);
+}
+
+
+
+
+//=============================================================================
+// Writes one sector into the overlay.  A sector already in the overlay is
+// just overwritten.  A sector that's all one value only needs its index
+// entry, or nothing at all if it matches a sparse image's fill.  Otherwise
+// the data gets appended first and then hooked into the index (adding an
+// index page if needed), so a power failure never leaves the index pointing
+// at garbage.  Returns true on success.
+
+bool Disk::overlayWrite(unsigned long offset, byte *buf)
+{
+        unsigned long sector = offset / sectorSize;
+        word chunk;
+        word page;
+        word entry;
+        
+        if (!overlayFind(sector, &chunk, &page))
+        {
+                return false;
+        }
+        if (chunk != 0 && !(chunk & FILL_SECTOR))
+        {
+                return overlay.seek((unsigned long)chunk * sectorSize) &&
+                       writeBlock(overlay, buf, sectorSize);
+        }
+
+        if (isFilled(buf))
+        {
+                entry = FILL_SECTOR | buf[0];
+                if (imageType == IMAGE_SPARSE && buf[0] == sparseFill)
+                {
+                        entry = 0;
+                }
+                if (entry == chunk)
+                {
+                        return true;    // the index already says so
+                }
+        }
+        else if (!overlayAppend(buf, &entry))
+        {
+                return false;
+        }
+        if (page == 0)
+        {
+                if (!overlayAppend(NULL, &page) ||
+                    !writeWord(sectorSize + (sector / perPage) * 2, page))
+                {
+                        return false;
+                }
+        }
+        return writeWord((unsigned long)page * sectorSize + (sector % perPage) * 2, entry);
+}
+
+
+
+
+//=============================================================================
+// Returns true if every byte of the sector has the same value.
+
+bool Disk::isFilled(byte *buf)
+{
+        for (unsigned i = 1; i < sectorSize; i++)
+        {
+                if (buf[i] != buf[0])
+                {
+                        return false;
+                }
+        }
+        return true;
+}
+
+
+
+
+//=============================================================================
+// Appends one chunk to the end of the overlay, either the given sector or
+// all zeros if buf is NULL, and returns its number in chunk.  The top bit of
+// an index entry marks a FILL_SECTOR, which limits an overlay to 32767
+// chunks.  Returns true on success.
+
+bool Disk::overlayAppend(byte *buf, word *chunk)
+{
+        static const byte zeros[16] = { 0 };
+        
+        if (nextChunk >= FILL_SECTOR)
+        {
+                Serial.println("Overlay is full");
+                return false;
+        }
+        if (!overlay.seek(nextChunk * sectorSize))
+        {
+                return false;
+        }
+
+        if (buf != NULL)
+        {
+                if (!writeBlock(overlay, buf, sectorSize))
+                {
+                        return false;
+                }
+        }
+        else
+        {
+                for (unsigned i = 0; i < sectorSize; i += sizeof(zeros))
+                {
+                        if (!writeBlock(overlay, zeros, sizeof(zeros)))
+                        {
+                                return false;
+                        }
+                }
+        }
+        *chunk = nextChunk++;
+        return true;
+}
+
+
+
+
+//=============================================================================
+// Read and write one little-endian word in the overlay file.  Both return
+// true on success.
+
+bool Disk::readWord(unsigned long pos, word *value)
+{
+        byte buf[2];
+        
+        if (!overlay.seek(pos) || readBlock(overlay, buf, 2) != 2)
+        {
+                return false;
+        }
+        *value = buf[0] | (buf[1] << 8);
+        return true;
+}
+
+
+
+bool Disk::writeWord(unsigned long pos, word value)
+{
+        byte buf[2];
+
+        buf[0] = value & 0xff;
+        buf[1] = value >> 8;
+        return overlay.seek(pos) && writeBlock(overlay, buf, 2);
+}
+
+
+
+
+//=============================================================================
+// Copies every sector in the overlay back into the base image, then empties
+// the overlay.  The base is opened for writing just long enough to do it, and
+// the write-intent record is marked for the copy and cleared right after.  A
+// cache line is used as scratch space since the cache is empty by then.
+// Returns true on success.
+
+bool Disk::mergeOverlay(void)
+{
+        if (imageType != IMAGE_OVERLAY)
+        {
+                errorCode = ERR_NOT_IMPLEMENTED;
+                return false;
+        }
+        
+        bool ret = flush();
+        invalidateCache();
+        resetReadCache();
+        
+        file.close();
+        file = SD.open(filename, O_RDWR);
+        filePos = POSITION_UNKNOWN;
+        if (!file)
+        {
+                Serial.println("Can't open base image for writing");
+                file = SD.open(filename, FILE_READ);
+                errorCode = ERR_WRITE_ERROR;
+                return false;
+        }
+
+        markIntent();
+        byte *scratch = cache[0].data;
+        unsigned long merged = 0;
+        
+        for (unsigned long sector = 0; ret && sector < overlaySectors; sector++)
+        {
+                word chunk;
+                word page;
+                
+                if (!overlayFind(sector, &chunk, &page))
+                {
+                        ret = false;
+                }
+                else if (page == 0)
+                {
+                        sector += perPage - sector % perPage - 1;   // whole page is empty
+                }
+                else if (chunk != 0)
+                {
+                        if (chunk & FILL_SECTOR)
+                        {
+                                memset(scratch, chunk & 0xff, sectorSize);
+                        }
+                        else if (!overlay.seek((unsigned long)chunk * sectorSize) ||
+                                 (unsigned)readBlock(overlay, scratch, sectorSize) != sectorSize)
+                        {
+                                ret = false;
+                        }
+                        if (ret && (!seekTo(sector * sectorSize) || !writeBlock(file, scratch, sectorSize)))
+                        {
+                                ret = false;
+                        }
+                        filePos = POSITION_UNKNOWN;
+                        merged++;
+                }
+        }
+        file.flush();
+        clearIntent();
+
+        file.close();
+        file = SD.open(filename, FILE_READ);
+        filePos = 0;
+        
+        Serial.print("Merged ");
+        Serial.print(merged);
+        Serial.println(" sectors from overlay");
+        
+        if (!ret)
+        {
+                errorCode = ERR_WRITE_ERROR;
+                return false;
+        }
+        return discardOverlay();
+}
+
+
+
+
+//=============================================================================
+// Throws away everything in the overlay, including any writes still in the
+// cache, and starts a new empty one.  Returns true on success.
+
+bool Disk::discardOverlay(void)
+{
+        char name[FNAME_SIZE + 1];
+        
+        if (imageType != IMAGE_OVERLAY)
+        {
+                errorCode = ERR_NOT_IMPLEMENTED;
+                return false;
+        }
+
+        invalidateCache();
+        resetReadCache();
+        overlay.close();
+        overlayName(name);
+        SD.remove(name);
+        
+        if (!openOverlay())
+        {
+                // Without an overlay there's nowhere for writes to go.
+                
+                imageType = IMAGE_RAW;
+                readOnlyFlag = true;
+                errorCode = ERR_WRITE_ERROR;
+                return false;
+        }
+
+        // Anything in RAM came from the overlay that's gone now.
+        
+        if (ramSectors != 0 && !fillRam())
+        {
+                releaseRam();
+                errorCode = ERR_READ_ERROR;
+                return false;
+        }
+        return true;
+}
+
+
+
+
+//=============================================================================
+// Makes the first sectors of the mounted image RAM-resident, or the whole
+// image if sectors is RAM_WHOLE_IMAGE or more than the image has.  The window
+// is rounded up to whole cache lines so a write cache line never covers a
+// RAM-resident sector.  The RAM comes from the heap, and if taking it would
+// leave less than RAM_DRIVE_RESERVE bytes free this fails with ERR_NO_MEMORY
+// and the drive carries on as it was.  Returns true on success.
+
+bool Disk::loadRam(unsigned sectors)
+{
+        unsigned long imageSectors = imageSize / sectorSize;
+        unsigned perLine = CACHE_LINE_SIZE / sectorSize;
+        
+        releaseRam();
+        if (sectors > imageSectors)
+        {
+                sectors = imageSectors;
+        }
+        if (sectors % perLine)
+        {
+                sectors += perLine - sectors % perLine;
+                if (sectors > imageSectors)
+                {
+                        sectors = imageSectors;
+                }
+        }
+        if (sectors == 0)
+        {
+                return true;    // nothing to keep
+        }
+
+        // Sectors in the write cache must get to the file before the RAM
+        // copy is read from it.
+        
+        flush();
+        invalidateCache();
+        resetReadCache();
+        
+        unsigned long bytes = (unsigned long)sectors * sectorSize;
+        unsigned mapBytes = (sectors + 7) / 8;
+        long avail = (long)freeMemory() - RAM_DRIVE_RESERVE;
+        
+        Serial.print("RAM drive needs ");
+        Serial.print(bytes + mapBytes);
+        Serial.print(" bytes, ");
+        Serial.print(avail < 0 ? 0 : avail);
+        Serial.println(" available");
+        
+        if ((long)(bytes + mapBytes) > avail ||
+            (ramImage = (byte *)malloc(bytes)) == NULL ||
+            (ramDirty = (byte *)malloc(mapBytes)) == NULL)
+        {
+                Serial.println("Not enough RAM, not keeping image in RAM");
+                releaseRam();
+                errorCode = ERR_NO_MEMORY;
+                return false;
+        }
+
+        ramSectors = sectors;
+        if (!fillRam())
+        {
+                releaseRam();
+                errorCode = ERR_READ_ERROR;
+                return false;
+        }
+        return true;
+}
+
+
+
+
+//=============================================================================
+// Reads the RAM-resident sectors from the image (or its overlay) and marks
+// them all clean.  Returns true on success.
+
+bool Disk::fillRam(void)
+{
+        for (unsigned i = 0; i < ramSectors; i++)
+        {
+                if (!readFromFile((unsigned long)i * sectorSize, ramImage + (unsigned long)i * sectorSize))
+                {
+                        return false;
+                }
+        }
+        memset(ramDirty, 0, (ramSectors + 7) / 8);
+        ramPending = false;
+        return true;
+}
+
+
+
+
+//=============================================================================
+// Gives the RAM-resident sectors back to the heap.  Anything dirty must have
+// been flushed first.
+
+void Disk::releaseRam(void)
+{
+        free(ramImage);
+        free(ramDirty);
+        ramImage = ramDirty = NULL;
+        ramSectors = 0;
+        ramPending = false;
+}
+
+
+
+
+//=============================================================================
+// This is called with the offset of each sector the host reads and keeps
+// track of the distance between reads.  If the same distance repeats, it's a
+// sequential (or stride) run and prefetch() has something to do.  When the
+// run is broken, sectors read ahead for it are no longer expected to be used,
+// though they stay in the cache.
+
+void Disk::trackReadPattern(unsigned long offset)
+{
+        long delta = (long)(offset - lastReadOffset);
+        
+        readCount++;
+        lastReadOffset = offset;
+        
+        if (delta != 0 && delta == readStride)
+        {
+                if (strideCount < 255)
+                {
+                        strideCount++;
+                }
+        }
+        else
+        {
+                for (int i = 0; i < READ_CACHE_SECTORS; i++)
+                {
+                        if (readCache[i].drive == driveNumber)
+                        {
+                                readCache[i].prefetched = false;
+                        }
+                }
+                readStride = delta;
+                strideCount = 1;
+                nextPrefetch = offset + delta;
+                return;
+        }
+
+        // Don't prefetch anything the host has already gone past.
+        
+        if ((long)(nextPrefetch - offset) / readStride <= 0)
+        {
+                nextPrefetch = offset + readStride;
+        }
+}
+
+
+
+
+//=============================================================================
+// Called between host commands.  If the host is in the middle of a
+// sequential run, this reads the next sector of the run into the FIFO part
+// of the read cache.  Only one sector is read per call so the link doesn't
+// wait too long.  Returns true if a sector was read.
+
+bool Disk::prefetch(void)
+{
+        long stride = readStride;
+        cacheEntry_t *slot;
+        
+        if (!mountedFlag || !isOpenF)
+        {
+                return false;
+        }
+
+        // A FLEX link is a sure thing, so it goes first.
+        
+        if (linkPending)
+        {
+                linkPending = false;
+                slot = allocEntry(true);
+                if (slot != NULL && fetchInto(slot, linkTarget))
+                {
+                        linkFetches++;
+                        return true;
+                }
+                return false;
+        }
+        
+        if (strideCount < READ_AHEAD_TRIGGER)
+        {
+                return false;
+        }
+        if (stride % (long)sectorSize != 0 || stride > (long)READ_AHEAD_MAX_STRIDE * sectorSize ||
+            stride < -(long)READ_AHEAD_MAX_STRIDE * sectorSize)
+        {
+                return false;
+        }
+
+        // Don't get too far ahead of the host.
+        
+        if ((long)(nextPrefetch - lastReadOffset) / stride > READ_AHEAD_SECTORS)
+        {
+                return false;
+        }
+        
+        // If the sector is already buffered, or is in the write cache, just
+        // move along.
+        
+        if (findCached(nextPrefetch) == NULL && findReadCached(nextPrefetch) == NULL)
+        {
+                slot = allocEntry(true);
+                if (slot == NULL)
+                {
+                        return false;
+                }
+                if (!fetchInto(slot, nextPrefetch))
+                {
+                        strideCount = 0;    // give up on this run
+                        return false;
+                }
+                readAheadFetches++;
+        }
+        nextPrefetch += stride;
+        return true;
+}
+
+
+
+
+//=============================================================================
+// Reads the sector at the given offset into a free read cache entry as a
+// read-ahead sector.  Returns true if it worked.  A prefetch failure isn't
+// the host's problem, so it doesn't change the error code they see.
+
+bool Disk::fetchInto(cacheEntry_t *slot, unsigned long offset)
+{
+        if (offset + sectorSize > imageSize)
+        {
+                return false;
+        }
+        
+        byte savedError = errorCode;
+        bool ok = readFromFile(offset, slot->data);
+        errorCode = savedError;
+        
+        if (ok)
+        {
+                slot->offset = offset;
+                slot->drive = driveNumber;
+                slot->queue = RC_IN;
+                slot->prefetched = true;
+                slot->stamp = ++tick;
+        }
+        return ok;
+}
+
+
+
+
+//=============================================================================
+// Given a sector just sent to the host, look at the FLEX link in the first
+// two bytes and, if it points somewhere the normal read-ahead won't cover,
+// arrange for prefetch() to get it.  A link of 0/0 is the end of the file.
+// This needs the geometry the host passes with track/sector reads.
+
+void Disk::followLink(unsigned long offset, byte *buf)
+{
+        byte track = buf[0];
+        byte sector = buf[1];
+        
+        if (sectorsPerTrack == 0 || (track == 0 && sector == 0))
+        {
+                return;
+        }
+        if (sector < FLEX_FIRST_SECTOR || sector >= sectorsPerTrack + FLEX_FIRST_SECTOR)
+        {
+                return;     // not a link, probably not a FLEX data sector
+        }
+        
+        unsigned long target = ((unsigned long)track * sectorsPerTrack + (sector - FLEX_FIRST_SECTOR)) * sectorSize;
+        if (target == offset || findCached(target) != NULL || findReadCached(target) != NULL)
+        {
+                return;
+        }
+
+        // If the stride logic is about to get it anyway, leave it alone.
+        
+        if (strideCount >= READ_AHEAD_TRIGGER && target == nextPrefetch)
+        {
+                return;
+        }
+        
+        linkTarget = target;
+        linkPending = true;
+}
+
+
+
+
+//=============================================================================
+// Returns the number of read-ahead sectors in the cache the host hasn't
+// asked for yet.
+
+byte Disk::getReadAheadDepth(void)
+{
+        byte depth = 0;
+        
+        for (int i = 0; i < READ_CACHE_SECTORS; i++)
+        {
+                if (readCache[i].queue != RC_FREE && readCache[i].drive == driveNumber &&
+                    readCache[i].prefetched)
+                {
+                        depth++;
+                }
+        }
+        return depth;
+}
+
+
+
+
+//=============================================================================
+// Given a file offset, return a pointer to the read cache entry holding that
+// sector, or NULL if it isn't there.
+
+cacheEntry_t *Disk::findReadCached(unsigned long offset)
+{
+        for (int i = 0; i < READ_CACHE_SECTORS; i++)
+        {
+                if (readCache[i].queue != RC_FREE && readCache[i].drive == driveNumber &&
+                    readCache[i].offset == offset)
+                {
+                        return &readCache[i];
+                }
+        }
+        return NULL;
+}
+
+
+
+
+//=============================================================================
+// Called with a sector just read from the card for the host.  This decides
+// which part of the read cache it belongs in and puts it there.  System
+// sectors get pinned if that's turned on and there's room, both in the pool
+// and in this drive's share, sectors still remembered in the ghost list have
+// been read recently enough to go into the main part, and everything else
+// starts out in the FIFO.
+
+void Disk::cacheSector(unsigned long offset, byte *buf)
+{
+        byte queue = RC_IN;
+        byte pinned = 0;
+        byte ours = 0;
+
+        for (int i = 0; i < READ_CACHE_SECTORS; i++)
+        {
+                if (readCache[i].queue == RC_PINNED)
+                {
+                        pinned++;
+                        if (readCache[i].drive == driveNumber)
+                        {
+                                ours++;
+                        }
+                }
+        }
+        
+        if (pinSystem && pinned < READ_CACHE_PINNED && ours < READ_CACHE_PIN_DRIVE &&
+            isSystemSector(offset))
+        {
+                queue = RC_PINNED;
+        }
+        else if (takeGhost(offset))
+        {
+                queue = RC_MAIN;
+        }
+
+        cacheEntry_t *entry = allocEntry(false);
+        if (entry != NULL)
+        {
+                entry->queue = queue;
+                entry->drive = driveNumber;
+                entry->offset = offset;
+                entry->prefetched = false;
+                entry->stamp = ++tick;
+                memcpy(entry->data, buf, sectorSize);
+        }
+}
+
+
+
+
+//=============================================================================
+// Frees up a read cache entry and returns it, or NULL if there isn't one to
+// be had.  Every drive's entries are candidates.  A free entry is used first.  Otherwise, as 2Q does, the oldest
+// FIFO entry is pushed out (and its offset added to the ghost list) if the
+// FIFO has its full share or there's nothing in the main part, else the least
+// recently used main entry goes.  Pinned entries never leave.  With fifoOnly
+// set, as for read-ahead, only the FIFO is used so sectors being reused are
+// never pushed out by guesses.
+
+cacheEntry_t *Disk::allocEntry(bool fifoOnly)
+{
+        cacheEntry_t *oldestIn = NULL;
+        cacheEntry_t *lruMain = NULL;
+        byte inCount = 0;
+        
+        for (int i = 0; i < READ_CACHE_SECTORS; i++)
+        {
+                cacheEntry_t *entry = &readCache[i];
+                
+                switch (entry->queue)
+                {
+                        case RC_FREE:
+                                return entry;
+
+                        case RC_IN:
+                                inCount++;
+                                if (oldestIn == NULL || (int16_t)(entry->stamp - oldestIn->stamp) < 0)
+                                {
+                                        oldestIn = entry;
+                                }
+                                break;
+
+                        case RC_MAIN:
+                                if (lruMain == NULL || (int16_t)(entry->stamp - lruMain->stamp) < 0)
+                                {
+                                        lruMain = entry;
+                                }
+                                break;
+                }
+        }
+
+        if (oldestIn != NULL && (fifoOnly || inCount >= READ_CACHE_IN || lruMain == NULL))
+        {
+                ghost[ghostNext].offset = oldestIn->offset;
+                ghost[ghostNext].drive = oldestIn->drive;
+                ghostNext = (ghostNext + 1) % READ_CACHE_GHOSTS;
+                oldestIn->queue = RC_FREE;
+                return oldestIn;
+        }
+        if (!fifoOnly && lruMain != NULL)
+        {
+                lruMain->queue = RC_FREE;
+                return lruMain;
+        }
+        return NULL;
+}
+
+
+
+
+//=============================================================================
+// If this drive's offset is in the ghost list, take it out and return true.
+
+bool Disk::takeGhost(unsigned long offset)
+{
+        for (int i = 0; i < READ_CACHE_GHOSTS; i++)
+        {
+                if (ghost[i].offset == offset && ghost[i].drive == driveNumber)
+                {
+                        ghost[i].offset = POSITION_UNKNOWN;
+                        return true;
+                }
+        }
+        return false;
+}
+
+
+
+
+//=============================================================================
+// Returns true if the offset is one of the FLEX system sectors on track 0:
+// the System Information Record or the directory.  This needs the geometry
+// the host passes with track/sector reads.
+
+bool Disk::isSystemSector(unsigned long offset)
+{
+        if (sectorsPerTrack == 0 || offset >= (unsigned long)sectorsPerTrack * sectorSize)
+        {
+                return false;
+        }
+        
+        unsigned long sector = offset / sectorSize + FLEX_FIRST_SECTOR;
+        return (sector == FLEX_SIR_SECTOR || sector >= FLEX_DIR_SECTOR);
+}
+
+
+
+
+//=============================================================================
+// Forgets any read pattern and takes this drive's sectors out of the read
+// cache.
+
+void Disk::resetReadCache(void)
+{
+        for (int i = 0; i < READ_CACHE_SECTORS; i++)
+        {
+                if (readCache[i].drive == driveNumber)
+                {
+                        readCache[i].queue = RC_FREE;
+                        readCache[i].prefetched = false;
+                }
+        }
+        for (int i = 0; i < READ_CACHE_GHOSTS; i++)
+        {
+                if (ghost[i].drive == driveNumber)
+                {
+                        ghost[i].offset = POSITION_UNKNOWN;
+                }
+        }
+        lastReadOffset = 0;
+        readStride = 0;
+        strideCount = 0;
+        nextPrefetch = 0;
+        linkPending = false;
+}
+
+
+
+
+//=============================================================================
+// Throws away everything in the cache.  Only call this after flushing or
+// when the data is no longer wanted.
+
+void Disk::invalidateCache(void)
+{
+        for (int i = 0; i < WRITE_CACHE_LINES; i++)
+        {
+                cache[i].validMask = 0;
+                cache[i].dirtyMask = 0;
+        }
+}
+
+
+
+
+//=============================================================================
+// Marks this drive's write-intent record with the image name, unless it is
+// marked already.  If the record can't be written, the next batch tries again.
+
+void Disk::markIntent(void)
+{
+        if (!intentMarked)
+        {
+                intentMarked = writeIntent(driveNumber, filename);
+        }
+}
+
+
+
+
+//=============================================================================
+// Clears this drive's write-intent record if it is marked.
+
+void Disk::clearIntent(void)
+{
+        if (intentMarked)
+        {
+                writeIntent(driveNumber, NULL);
+                intentMarked = false;
+        }
+}
+
+
+
+
+//=============================================================================
+// Closes the write-intent file.  Call this when the card goes away; it is
+// opened again the next time a record is written.
+
+void Disk::closeIntent(void)
+{
+        intentFile.close();
+}
+
+
+
+
+//=============================================================================
+// Opens the write-intent file if it isn't open yet.  A new or short file is
+// padded out to a record per drive, so later writes never make it longer.
+// Returns true if it's open.
+
+static bool openIntent(void)
+{
+        if (!intentFile)
+        {
+                intentFile = SD.open(INTENT_FILE, O_RDWR | O_CREAT);   // not FILE_WRITE, it appends
+                if (!intentFile)
+                {
+                        return false;
+                }
+                
+                unsigned long size = intentFile.size();
+                if (size < INTENT_FILE_SIZE)
+                {
+                        byte zeros[INTENT_FILE_SIZE];
+                        
+                        memset(zeros, 0, sizeof(zeros));
+                        intentFile.seek(size);
+                        writeBlock(intentFile, zeros, INTENT_FILE_SIZE - size);
+                        intentFile.flush();
+                }
+        }
+        return true;
+}
+
+
+
+
+//=============================================================================
+// Writes one write-intent record in place.  Given an image name, this marks a
+// batch to that image as in progress.  Given NULL, it clears the record.  The
+// flush gets it onto the card before the batch starts.  Returns true if it
+// was written.
+
+static bool writeIntent(byte slot, const char *name)
+{
+        byte record[INTENT_RECORD_SIZE];
+        
+        memset(record, 0, sizeof(record));
+        if (name != NULL)
+        {
+                strncpy((char *)record, name, FNAME_SIZE);
+        }
+
+        if (!openIntent() ||
+            !intentFile.seek((unsigned long)slot * INTENT_RECORD_SIZE) ||
+            !writeBlock(intentFile, record, sizeof(record)))
+        {
+                return false;
+        }
+        intentFile.flush();
+        return true;
+}
+
+
+
+
+//=============================================================================
+// Called when an image is mounted on the drive that owns the given record.
+// If the record names this image, a write to it may not have finished, so
+// the record is cleared and true is returned so the problem can be reported.
+// Other drives' records are left alone, since the same image can be mounted
+// on another drive with a write of its own still pending.
+
+static bool checkIntent(byte slot, const char *name)
+{
+        byte record[INTENT_RECORD_SIZE];
+        
+        if (!intentFile && !SD.exists(INTENT_FILE))
+        {
+                return false;
+        }
+        if (!openIntent())
+        {
+                return false;
+        }
+
+        if (intentFile.seek((unsigned long)slot * INTENT_RECORD_SIZE) &&
+            readBlock(intentFile, record, sizeof(record)) == sizeof(record) &&
+            record[0] != 0 &&
+            strncmp((char *)record, name, FNAME_SIZE) == 0)
+        {
+                writeIntent(slot, NULL);
+                return true;
+        }
+        return false;
+}
@@ -10,13 +10,24 @@
 #define __DISK_H__
 
 #include <SD.h>
-#include "Event.h"
+#include "EventPool.h"
+#include "Latency.h"
+#include "Trace.h"
 
 
-// Max sector size supported.  Using Flex, the only sector size supported
-// is 256 bytes.
+// Sets the number of drives supported.  This depends on the OS, but FLEX
+// only supports four.  The RAM for the caches is split between them.
 
-#define SECTOR_SIZE  256
+#define MAX_DISKS  4
+
+
+// Sector size used unless the mount asks for something else.  This is the
+// FLEX sector size.  The code is the protocol's sector size code (1 = 128,
+// 2 = 256, 3 = 512, 4 = 1024).  The largest size allowed is MAX_SECTOR_SIZE
+// in Event.h.
+
+#define DEFAULT_SECTOR_SIZE  256
+#define DEFAULT_SECTOR_CODE  2
 
 
 // The file name size is fixed by the Arduino SD library.  It only supports
@@ -25,16 +36,258 @@
 #define FNAME_SIZE  12  // xxxxxxxx.xxx
 
 
+// Each drive has a small write-back cache.  Writes from the host are put into
+// the cache and ACKed right away, then written to the SD card later when
+// things are idle.  FLEX rewrites the same directory and SIR sectors over and
+// over, so even a little cache avoids most of the SD flushes.
+//
+// The cache is made of lines lined up with the card's 512 byte blocks.  The
+// card can only program whole blocks, so a lone 256 byte sector write turns
+// into a read-modify-write of the block.  Two neighbouring sectors that land
+// in the same line go out together as one block instead, and if only part of
+// a line is dirty the rest is read in first so the card still gets a whole
+// block.  Each line costs CACHE_LINE_SIZE bytes of RAM per drive, so keep
+// WRITE_CACHE_LINES small.  A line holds at most 8 sectors.
+
+#define CARD_BLOCK_SIZE  512
+
+#if MAX_SECTOR_SIZE > CARD_BLOCK_SIZE
+#define CACHE_LINE_SIZE  MAX_SECTOR_SIZE
+#else
+#define CACHE_LINE_SIZE  CARD_BLOCK_SIZE
+#endif
+
+#define WRITE_CACHE_LINES  1
+
+// Number of milliseconds a dirty sector is allowed to sit in the cache before
+// the idle poll writes it to the card.
+
+#define WRITE_BACK_DELAY  500
+
+// How hard each drive works at getting writes onto the card.  Cached writes
+// always go out as one batch with a single file flush.  FLUSH_SECTOR writes
+// and flushes every sector before the host gets its ACK, which is slow but is
+// how things used to work.  FLUSH_TIMER writes the batch once the oldest
+// sector is WRITE_BACK_DELAY ms old or every cache line is completely dirty.
+// FLUSH_DONE holds the batch until the host sends DONE (or the cache fills),
+// which is fastest but leaves data in RAM if the host never sends one.  These
+// values are also the digit used after F in the config file.
+
+typedef enum
+{
+        FLUSH_SECTOR = 0,
+        FLUSH_TIMER = 1,
+        FLUSH_DONE = 2,
+} flushMode_t;
+
+#define DEFAULT_FLUSH_MODE  FLUSH_TIMER
+
+// Before a batch of more than one sector is written, the image name goes into
+// the drive's record in this little file.  The record isn't cleared after
+// each batch, only once the drive has had nothing to write for
+// INTENT_CLEAR_DELAY ms or is unmounted, so a drive that is busy writing
+// marks its record once for a whole string of batches.  If the name is still
+// there when the image is next mounted on that drive, a write may have been
+// interrupted and the image may be inconsistent.  The file has a record for
+// every drive, is made full size the first time it's opened and then stays
+// open, so marking or clearing a record rewrites one block in place.  The
+// leading underscore hides it from the directory listing.
+
+#define INTENT_FILE  "_INTENT.SYS"
+#define INTENT_RECORD_SIZE  (FNAME_SIZE + 1)
+#define INTENT_FILE_SIZE  (MAX_DISKS * INTENT_RECORD_SIZE)
+#define INTENT_CLEAR_DELAY  2000
+
+// Read-ahead.  When the host reads sectors in a sequential (or fixed stride)
+// pattern, the next READ_AHEAD_SECTORS sectors are read into RAM between host
+// commands so the next request is answered without touching the card.  The
+// pattern has to repeat READ_AHEAD_TRIGGER times before read-ahead starts,
+// and strides larger than READ_AHEAD_MAX_STRIDE sectors are ignored.
+
+#define READ_AHEAD_SECTORS  2
+#define READ_AHEAD_TRIGGER  2
+#define READ_AHEAD_MAX_STRIDE  8
+
+// The read cache, which also holds the read-ahead sectors, is one pool
+// shared by all the drives.  It gets whatever RAM is left once everything
+// else has had its share.  Split four ways there would only be three entries
+// per drive, too few for 2Q or pinning to do anything, and an idle drive
+// would tie up a quarter of it.
+//
+// SRAM_RESERVED is everything outside the caches and the Event pool on a Mega
+// 2560, added up from the Arduino core, SD and Wire library sources and the
+// sketch's own objects:
+//
+//      SRAM_LIBRARIES  Serial's buffers (157), the SD library's block buffer
+//                      and volume (about 600) and the Wire and twi buffers
+//                      for the clock (about 180)
+//      SRAM_OBJECTS    the Disk objects apart from their write lines (about
+//                      190 bytes each), Disks, the Link, the other File
+//                      handles and the SD library's state for each open file
+//      SRAM_STACK      room left for the stack
+//
+// plus the latency histograms and trace buffer when they're built in.  At the
+// end of setup the sketch checks how much is really left for the stack and
+// says how much to add here if it's less than SRAM_STACK.
+
+#define SRAM_TOTAL  8192
+#define SRAM_LIBRARIES  960
+#define SRAM_OBJECTS  1100
+#define SRAM_STACK  512
+#define SRAM_RESERVED  (SRAM_LIBRARIES + SRAM_OBJECTS + SRAM_STACK + LATENCY_RAM_USED + TRACE_RAM_USED)
+
+// Each entry costs the sector plus its bookkeeping, and two ghosts.
+
+#define READ_CACHE_BUDGET  (SRAM_TOTAL - SRAM_RESERVED - EVENT_POOL_BYTES - \
+                            MAX_DISKS * WRITE_CACHE_LINES * CACHE_LINE_SIZE)
+#define READ_CACHE_SECTORS  (READ_CACHE_BUDGET / (MAX_SECTOR_SIZE + 9 + 2 * 5))
+
+// The cache uses the 2Q policy so one long sequential read, like a full disk
+// COPY, can't push out the sectors that are really being reused.  A sector
+// read for the first time goes into a small FIFO (RC_IN), along with the
+// read-ahead sectors.  When it drops out of the FIFO only its offset is kept,
+// in the ghost list, and if it is read again while still remembered it goes
+// into the LRU main part (RC_MAIN).  Scans only ever churn the FIFO.
+//
+// A drive can also pin the FLEX System Information Record and the directory
+// sectors on track 0 (RC_PINNED) so they are never pushed out.  The drives
+// can pin READ_CACHE_PINNED entries between them, and no more than
+// READ_CACHE_PIN_DRIVE each.
+//
+// With the defaults that is 9 entries: a FIFO of 2, up to 4 pinned, at least
+// 3 in the main part, and 18 ghosts.  With the latency histograms and the
+// trace recorder built in it drops to 7 entries, 2 in the FIFO, up to 3
+// pinned and at least 2 in the main part.
+
+#define READ_CACHE_IN  (READ_CACHE_SECTORS / 4 > READ_AHEAD_SECTORS ? READ_CACHE_SECTORS / 4 : READ_AHEAD_SECTORS)
+#define READ_CACHE_PINNED  (READ_CACHE_SECTORS / 2)
+#define READ_CACHE_PIN_DRIVE  3
+#define READ_CACHE_GHOSTS  (2 * READ_CACHE_SECTORS)
+
+#if READ_CACHE_SECTORS - READ_CACHE_IN - READ_CACHE_PINNED < 2
+#error "Not enough RAM left for a useful read cache"
+#endif
+
+enum
+{
+        RC_FREE,
+        RC_IN,
+        RC_MAIN,
+        RC_PINNED,
+};
+
+// Where the FLEX system sectors live on track 0.
+
+#define FLEX_SIR_SECTOR  3
+#define FLEX_DIR_SECTOR  5
+
+// FLEX data sectors start with a two byte link (track, sector) to the next
+// sector of the file.  When link prefetching is turned on for a drive, the
+// link in every sector sent to the host is used to prefetch the next sector
+// of the chain, which catches fragmented files the stride logic misses.
+// FLEX sector numbers start at 1.
+
+#define FLEX_FIRST_SECTOR  1
+
+// The file position is tracked so the SD library only has to seek when the
+// host jumps around.  This value means the position isn't known.
+
+#define POSITION_UNKNOWN  0xffffffffUL
+
+// How the sectors of a drive are stored.  Normally the DSK file is read and
+// written directly (IMAGE_RAW).  An overlay mount (IMAGE_OVERLAY) opens the
+// DSK file read-only as a base and puts every sector the host writes into an
+// overlay file with the same name and an .OVL extension.  Reads check the
+// overlay's index first and fall back to the base.  The overlay can later be
+// merged into the base or thrown away.
+//
+// The overlay file is made of chunks one sector long.  Chunk 0 holds the
+// header, then comes a top-level table with a word per index page giving the
+// chunk holding that page (0 = no page yet).  Each index page is one chunk of
+// words, one per base sector, giving the chunk holding that sector's data
+// (0 = still in the base).  Index pages and data chunks are appended as the
+// host writes, so a new overlay is just the header and a table of about one
+// word per 128 sectors, and mounting one only reads the header.  A sector
+// written with every byte the same doesn't get a data chunk at all; its index
+// entry is FILL_SECTOR plus the byte value, so chunk numbers are 15 bits.
+//
+// A sparse image (IMAGE_SPARSE) is the same container with no base image
+// under it.  Sectors that were never written read back as the fill value in
+// the header, with no data I/O, so a freshly formatted disk is little more
+// than its index.  Mount spots one by the SPARSE_MAGIC at the start of the
+// file, whatever it's called, but SPARSE_EXT is used by the converter.
+
+typedef enum
+{
+        IMAGE_RAW,
+        IMAGE_OVERLAY,
+        IMAGE_SPARSE,
+} imageType_t;
+
+#define OVERLAY_MAGIC  0x314c564fUL     // "OVL1" on a little-endian CPU
+#define OVERLAY_EXT  "OVL"
+#define SPARSE_MAGIC  0x31525053UL      // "SPR1"
+#define SPARSE_EXT  "SPR"
+#define FILL_SECTOR  0x8000
+
+// The header is read and written as it sits in memory, so it uses fixed width
+// types to keep the files the same when the code is built for a PC.
+
+typedef struct
+{
+        uint32_t magic;
+        uint32_t sectors;               // sectors in the base image
+        uint16_t sectorSize;
+        uint16_t fill;                  // sparse images: value of unwritten sectors
+} overlayHeader_t;
+
+// A drive can keep the start of its image, or all of it if it's small
+// enough, in RAM.  Reads and writes of those sectors never touch the card;
+// written sectors are marked dirty and go back to the card following the
+// drive's flush mode, just like the write cache.  The RAM comes from the
+// heap when the drive is mounted, and the mount is refused if it would leave
+// less than RAM_DRIVE_RESERVE bytes free for the stack.  RAM_WHOLE_IMAGE asks
+// for the whole image.
+
+#define RAM_DRIVE_RESERVE  1024
+#define RAM_WHOLE_IMAGE  0xffff
+
+typedef struct
+{
+        unsigned long offset;           // offset of the line in the DSK file
+        byte validMask;                 // one bit per sector holding data
+        byte dirtyMask;                 // one bit per sector not written yet
+        unsigned long dirtyTime;        // millis() when the line became dirty
+        byte data[CACHE_LINE_SIZE];
+} cacheLine_t;
+
+typedef struct
+{
+        byte queue;                     // RC_xxx list the entry is on
+        byte drive;                     // drive the sector belongs to
+        bool prefetched;                // read ahead, host hasn't asked yet
+        word stamp;                     // when it went in, or was last used
+        unsigned long offset;           // offset of the sector in the DSK file
+        byte data[MAX_SECTOR_SIZE];
+} cacheEntry_t;
+
+typedef struct
+{
+        unsigned long offset;           // sector that left the FIFO
+        byte drive;
+} ghostEntry_t;
+
+
 class Disk
 {
         public:
-                Disk(void);
+                Disk(byte drive);
                 ~Disk(void);
                 bool isGood(void) { return goodFlag; }  
                 bool read(unsigned long offset, byte *buf);
                 bool write(unsigned long offset, byte *buf);
                 char *getFilename(void) { return filename; }
-                bool mount(char *afilename, bool readOnly);
+                bool mount(char *afilename, bool readOnly, byte sizeCode = DEFAULT_SECTOR_CODE, bool useOverlay = false);
                 void unmount(void);
                 bool isMounted(void) { return mountedFlag; }
                 bool isOpen(void) { return isOpenF; }
@@ -42,6 +295,41 @@ class Disk
                 byte getStatus(void);
                 byte getError(void) { return errorCode; }
                 bool isReadOnly(void) { return readOnlyFlag; }
+                bool isOverlay(void) { return imageType == IMAGE_OVERLAY; }
+                bool isSparse(void) { return imageType == IMAGE_SPARSE; }
+                bool mergeOverlay(void);
+                bool discardOverlay(void);
+                bool loadRam(unsigned sectors);
+                unsigned getRamSectors(void) { return ramSectors; }
+                unsigned getSectorSize(void) { return sectorSize; }
+                byte getSectorSizeCode(void) { return sectorSizeCode; }
+                bool flush(void);
+                void poll(void);
+                bool isDirty(void);
+                unsigned dirtyCount(void);
+                void setFlushMode(flushMode_t mode) { flushMode = mode; }
+                flushMode_t getFlushMode(void) { return flushMode; }
+                bool wasInterrupted(void) { return batchInterrupted; }
+                static void closeIntent(void);
+                bool prefetch(void);
+                unsigned long getReads(void) { return readCount; }
+                unsigned long getWrites(void) { return hostBytesWritten / sectorSize; }
+                unsigned long getReadAheadHits(void) { return readAheadHits; }
+                unsigned long getReadAheadFetches(void) { return readAheadFetches; }
+                byte getReadAheadDepth(void);
+                unsigned long getCacheHits(void) { return cacheHits; }
+                unsigned long getCacheMisses(void) { return cacheMisses; }
+                void setPinSystem(bool enable) { pinSystem = enable; }
+                bool isPinSystem(void) { return pinSystem; }
+                void setLinkPrefetch(bool enable) { linkPrefetch = enable; }
+                bool isLinkPrefetch(void) { return linkPrefetch; }
+                void setSectorsPerTrack(byte spt) { sectorsPerTrack = spt; }
+                unsigned long getLinkFetches(void) { return linkFetches; }
+                unsigned long getSeeks(void) { return seekCount; }
+                unsigned long getSeeksAvoided(void) { return seeksAvoided; }
+                unsigned long getHostBytesWritten(void) { return hostBytesWritten; }
+                unsigned long getCardBlocksWritten(void) { return cardBlocksWritten; }
+                unsigned long getFillReads(void) { return fillReads; }
         
         private:
                 bool goodFlag;
@@ -53,6 +341,104 @@ class Disk
                 void setError(byte err) { goodFlag = false; errorCode = err; }
                 char filename[FNAME_SIZE + 1];
                 byte errorCode;
+                unsigned sectorSize;            // bytes per sector for this image
+                byte sectorSizeCode;            // same, as a protocol size code
+                bool writeBackFailed;
+                flushMode_t flushMode;
+                bool batchInterrupted;          // intent record found at mount
+                byte driveNumber;               // which intent record is ours
+                bool intentMarked;              // our intent record names the image
+                unsigned long lastFlush;        // millis() of the last batch
+                void markIntent(void);
+                void clearIntent(void);
+                cacheLine_t cache[WRITE_CACHE_LINES];
+                byte *findCached(unsigned long offset);
+                cacheLine_t *findLine(unsigned long offset);
+                byte sectorBit(unsigned long offset) { return 1 << ((offset % CACHE_LINE_SIZE) / sectorSize); }
+                bool writeLine(cacheLine_t *line);
+                bool writeRun(unsigned long offset, byte *buf, unsigned length);
+
+                // Write amplification.  Every byte the host writes versus
+                // every card block programmed, plus the reads needed to fill
+                // out partial lines.
+                
+                unsigned long hostBytesWritten;
+                unsigned long cardBlocksWritten;
+                unsigned long fillReads;
+                void invalidateCache(void);
+                bool readFromFile(unsigned long offset, byte *buf);
+
+                // The image size is captured at mount time, and filePos
+                // follows every read and write, so bounds checks don't need
+                // to call into the SD library.
+                
+                unsigned long imageSize;
+                unsigned long filePos;
+                unsigned long seekCount;
+                unsigned long seeksAvoided;
+                bool seekTo(unsigned long offset);
+
+                // RAM-resident sectors
+                
+                byte *ramImage;                 // first ramSectors sectors of the image
+                byte *ramDirty;                 // one bit per sector in ramImage
+                unsigned ramSectors;
+                bool ramPending;                // some of them are dirty
+                unsigned long ramDirtyTime;     // millis() when the first one got dirty
+                bool inRam(unsigned long offset) { return offset / sectorSize < ramSectors; }
+                bool fillRam(void);
+                void releaseRam(void);
+
+                // Overlay
+                
+                imageType_t imageType;
+                File overlay;                   // also the container of a sparse image
+                byte sparseFill;
+                unsigned long overlaySectors;   // sectors covered by the index
+                word perPage;                   // index entries per page
+                unsigned long nextChunk;        // where the next append goes
+                bool openOverlay(void);
+                bool openSparse(char *name, overlayHeader_t *header, bool readOnly);
+                bool isFilled(byte *buf);
+                void overlayName(char *name);
+                bool overlayFind(unsigned long sector, word *chunk, word *page);
+                bool overlayWrite(unsigned long offset, byte *buf);
+                bool overlayAppend(byte *buf, word *chunk);
+                bool readWord(unsigned long pos, word *value);
+                bool writeWord(unsigned long pos, word value);
+
+                // Read cache
+                
+                bool pinSystem;                 // pin FLEX system sectors
+                unsigned long cacheHits;
+                unsigned long cacheMisses;
+                cacheEntry_t *findReadCached(unsigned long offset);
+                cacheEntry_t *allocEntry(bool fifoOnly);
+                void cacheSector(unsigned long offset, byte *buf);
+                bool isSystemSector(unsigned long offset);
+                bool takeGhost(unsigned long offset);
+
+                // Read-ahead state
+                
+                unsigned long lastReadOffset;   // offset of previous host read
+                long readStride;                // distance between the last two reads
+                byte strideCount;               // times in a row the stride repeated
+                unsigned long nextPrefetch;     // next offset to prefetch
+                unsigned long readCount;
+                unsigned long readAheadHits;
+                unsigned long readAheadFetches;
+                void trackReadPattern(unsigned long offset);
+                void resetReadCache(void);
+                bool fetchInto(cacheEntry_t *slot, unsigned long offset);
+
+                // FLEX link chain prefetching
+                
+                bool linkPrefetch;              // follow links in served sectors
+                byte sectorsPerTrack;           // from the host, 0 if not known
+                bool linkPending;               // linkTarget needs to be fetched
+                unsigned long linkTarget;       // offset of the next sector in the chain
+                unsigned long linkFetches;
+                void followLink(unsigned long offset, byte *buf);
 };
 
 #endif  // __DISK_H__
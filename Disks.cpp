@@ -9,6 +9,8 @@
 #include <SD.h>
 #include "Disks.h"
 #include "Errors.h"
+#include "SdFuncs.h"
+#include "Latency.h"
 
 // This is the configuration file that is read to get the initial files
 // to mount, and the backup copy when a change is saved.
@@ -18,6 +20,13 @@
 #define CONFIG_BACKUP_FILE  "SD.OLD"
 
 extern bool debounceInputPin(int pin);
+extern unsigned getSectorSize(byte code);
+extern int freeMemory(void);
+
+static bool makeSparse(File &from, File &to, unsigned sectorSize, byte fill);
+static bool makeRaw(File &from, File &to, overlayHeader_t *header);
+static bool getWord(File &file, unsigned long pos, word *value);
+static bool putWord(File &file, unsigned long pos, word value);
 
 // Pin with the presence sensor
 
@@ -36,9 +45,12 @@ Disks::Disks(void)
         
         for (int d = 0; d < MAX_DISKS; d++)
         {
-                disks[d] = new Disk();
+                disks[d] = new Disk(d);
         }
         state = FIRST_CHAR;   // for reading the config file
+        memset(errorCounts, 0, sizeof(errorCounts));
+        bytesToHost = bytesFromHost = 0;
+        maxTransaction = 0;
 
         userInt = UserInt::getInstance();
 
@@ -60,8 +72,9 @@ Disks::~Disks(void)
 
 
 //=============================================================================
-// This gets called every 100ms for whatever needs to be done.  Currently this
-// just monitors for SD card removals and insertions.
+// This gets called every 100ms for whatever needs to be done.  This monitors
+// for SD card removals and insertions, and gives each drive a chance to write
+// out cached sectors while the host is idle.
 
 void Disks::poll(void)
 {
@@ -96,6 +109,63 @@ void Disks::poll(void)
                 }
                 presentState = state;
         }
+
+        // Let the drives write out any old dirty sectors.
+
+        if (!presentState)
+        {
+                for (int d = 0; d < MAX_DISKS; d++)
+                {
+                        disks[d]->poll();
+                }
+        }
+}
+
+
+
+
+//=============================================================================
+// This gets called from the main loop whenever the host isn't in the middle
+// of a command.  It lets one drive do a bit of read-ahead work.  Drives take
+// turns so one busy drive doesn't starve the others.  Returns true if some
+// work was done.
+
+bool Disks::idle(void)
+{
+        static byte next = 0;
+
+        for (int i = 0; i < MAX_DISKS; i++)
+        {
+                byte d = next;
+                next = (next + 1) % MAX_DISKS;
+                
+                if (disks[d]->prefetch())
+                {
+                        return true;
+                }
+        }
+        return false;
+}
+
+
+
+
+//=============================================================================
+// Called when the host sends DONE.  Every drive writes out its batch of
+// cached sectors.  Returns false if any of them failed.
+
+bool Disks::commit(void)
+{
+        bool ret = true;
+        
+        for (int d = 0; d < MAX_DISKS; d++)
+        {
+                if (disks[d]->isOpen() && disks[d]->isDirty() && !disks[d]->flush())
+                {
+                        ret = false;
+                }
+        }
+        return ret;
 }
 
 
@@ -111,15 +181,36 @@ void Disks::poll(void)
 //    # comments
 //    x:filename.ext
 //    xR:filename.ext
+//    xL:filename.ext
+//    xP:filename.ext
+//    xO:filename.ext
+//    xSn:filename.ext
+//    xFn:filename.ext
+//    xMn:filename.ext
 //
-// Where 'r' is a digit from 0 to 3, R (if present) indicates read-only.
+// Where 'r' is a digit from 0 to 3, R (if present) indicates read-only, L (if
+// present) turns on FLEX link prefetching, P (if present) keeps the FLEX SIR
+// and directory sectors in the read cache, O (if present) mounts the file as a
+// read-only base with the writes kept in an overlay file, and S followed by a
+// protocol sector
+// size code (1 = 128, 2 = 256, 3 = 512, 4 = 1024) sets the sector size of the
+// image.  The default is 256 byte sectors.  F followed by a digit sets when
+// writes are flushed to the card: 0 = every sector, 1 = on a timer or when
+// the cache fills (the default), 2 = when the host sends DONE.  M keeps the
+// image in RAM; if it is followed by a number, only that many sectors from
+// the start of the image are kept.  If there isn't enough RAM the drive isn't
+// mounted.  The options can be combined.  Sparse images are recognized by
+// their header and need no option.
 //
 // Example:
 //
-//    0:SD_BOOT.DSK
-//    1:CT_UTILS.DSK
+//    0LP:SD_BOOT.DSK
+//    1F2:CT_UTILS.DSK
 //    2R:DANGER.DSK
-//    3:PLAY.DSK
+//    2O:FLEX_DIST.DSK
+//    3S3F0:OS9.DSK
+//    1M:FLEX_SYS.DSK
+//    1M20:BIGFLEX.DSK
 
 void Disks::mountDefaults(int which)
 {
@@ -152,12 +243,28 @@ void Disks::mountDefaults(int which)
                 }
 
                 // This is a crude little state machine that processes each
-                // character from the config file.
+                // character from the config file.  The file is read a chunk
+                // at a time rather than a byte at a time.  An option's value
+                // ends at the first character that isn't part of it, and
+                // that character is put back for AFTER_DRIVE to see.
                 
                 state = FIRST_CHAR;
-                while (file.available())
+                byte chunk[COPY_CHUNK_SIZE];
+                int chunkLength = 0;
+                int chunkIndex = 0;
+                
+                while (true)
                 {
-                        char token = file.read();   // get one character from file
+                        if (chunkIndex >= chunkLength)
+                        {
+                                chunkLength = readBlock(file, chunk, sizeof(chunk));
+                                chunkIndex = 0;
+                                if (chunkLength <= 0)
+                                {
+                                        break;      // end of file
+                                }
+                        }
+                        char token = chunk[chunkIndex++];   // get one character from file
 #if 0
                         Serial.print("Got char '");
                         Serial.print(token);
@@ -176,6 +283,13 @@ void Disks::mountDefaults(int which)
                                         {
                                                 drive = token - '0';  // compute drive
                                                 readOnly = false;
+                                                linkPrefetch = false;
+                                                pinSystem = false;
+                                                useOverlay = false;
+                                                sizeCode = DEFAULT_SECTOR_CODE;
+                                                flushMode = DEFAULT_FLUSH_MODE;
+                                                useRam = false;
+                                                ramSectors = 0;
                                                 state = AFTER_DRIVE;
                                         }
                                         break;
@@ -188,6 +302,16 @@ void Disks::mountDefaults(int which)
                                                 state = FIRST_CHAR;
                                         break;
            
+                                case AFTER_RAM:     // optional sector count
+                                        if (token >= '0' && token <= '9')
+                                        {
+                                                ramSectors = ramSectors * 10 + (token - '0');
+                                                break;
+                                        }
+                                        state = AFTER_DRIVE;
+                                        chunkIndex--;   // the character belongs to AFTER_DRIVE
+                                        break;
+
                                 case AFTER_DRIVE:    // should be either R or :
                                         if (token == ':')
                                         {
@@ -198,6 +322,55 @@ void Disks::mountDefaults(int which)
                                         {
                                                 readOnly = true;
                                         }
+                                        else if (token == 'L' || token == 'l')
+                                        {
+                                                linkPrefetch = true;
+                                        }
+                                        else if (token == 'P' || token == 'p')
+                                        {
+                                                pinSystem = true;
+                                        }
+                                        else if (token == 'O' || token == 'o')
+                                        {
+                                                useOverlay = true;
+                                        }
+                                        else if (token == 'S' || token == 's')
+                                        {
+                                                state = AFTER_SIZE;
+                                        }
+                                        else if (token == 'F' || token == 'f')
+                                        {
+                                                state = AFTER_FLUSH;
+                                        }
+                                        else if (token == 'M' || token == 'm')
+                                        {
+                                                useRam = true;
+                                                state = AFTER_RAM;
+                                        }
+                                        break;
+
+                                case AFTER_SIZE:    // sector size code
+                                        if (token >= '1' && token <= '4')
+                                        {
+                                                sizeCode = token - '0';
+                                        }
+                                        else if (token < '0' || token > '9')
+                                        {
+                                                chunkIndex--;   // no code, it's the next option
+                                        }
+                                        state = AFTER_DRIVE;
+                                        break;
+
+                                case AFTER_FLUSH:   // flush mode
+                                        if (token >= '0' && token <= '2')
+                                        {
+                                                flushMode = (flushMode_t)(token - '0');
+                                        }
+                                        else if (token < '0' || token > '9')
+                                        {
+                                                chunkIndex--;   // no mode, it's the next option
+                                        }
+                                        state = AFTER_DRIVE;
                                         break;
                                 
                                 case FILENAME:
@@ -205,7 +378,16 @@ void Disks::mountDefaults(int which)
                                         {
                                                 state = FIRST_CHAR;
                                                 *fnptr = '\0';    // terminate the filename
-                                                mount(drive, filename, readOnly);
+                                                if (useRam && ramSectors == 0)
+                                                {
+                                                        ramSectors = RAM_WHOLE_IMAGE;
+                                                }
+                                                if (mount(drive, filename, readOnly, sizeCode, useOverlay, ramSectors))
+                                                {
+                                                        disks[drive]->setLinkPrefetch(linkPrefetch);
+                                                        disks[drive]->setPinSystem(pinSystem);
+                                                        disks[drive]->setFlushMode(flushMode);
+                                                }
                                         }
                                         else if (token > ' ' && token < '~')
                                         {
@@ -229,6 +411,7 @@ void Disks::mountDefaults(int which)
 //=============================================================================
 // This closes any open files.  This is kind of an emergency sort of function
 // used to close open files in case another piece of code needs to open a file.
+// Closing a drive forces any cached writes out first.
 
 void Disks::closeAll(void)
 {
@@ -239,6 +422,7 @@ void Disks::closeAll(void)
                         disks[d]->close();
                 }
         }
+        Disk::closeIntent();
 }
 
 
@@ -281,10 +465,7 @@ bool Disks::saveConfig(void)
                 return ret;
         }
 
-        while (file.available())
-        {
-          ofile.write(file.read());
-        }
+        copyFile(file, ofile);
 
         ofile.close();
         file.close();
@@ -308,43 +489,62 @@ bool Disks::saveConfig(void)
                         written[d] = 0;
                 }
                 
-                while (file.available())
+                // Lines being copied are collected in outBuf and written a
+                // chunk at a time.  The buffer has to be emptied before
+                // writing a drive line so everything stays in order.
+                
+                byte inBuf[COPY_CHUNK_SIZE];
+                byte outBuf[COPY_CHUNK_SIZE];
+                int inLength;
+                int outLength = 0;
+                
+                while ((inLength = readBlock(file, inBuf, sizeof(inBuf))) > 0)
                 {
-                        char key = file.read();   // get next character
-
-                        switch (state)
+                        for (int i = 0; i < inLength; i++)
                         {
-                                case STATE_NEWLINE:   // handles first character on line
-                                        if (key >= '0' && key < MAX_DISKS+'0')
-                                        {
-                                                // replace old drive info with current info
+                                char key = inBuf[i];   // get next character
 
-                                                d = key - '0';
-                                                if (disks[d]->isOpen())
+                                switch (state)
+                                {
+                                        case STATE_NEWLINE:   // handles first character on line
+                                                if (key >= '0' && key < MAX_DISKS+'0')
                                                 {
-                                                        ofile.print(d);
-                                                        ofile.print(":");
-                                                        ofile.println(disks[d]->getFilename());
-                                                        written[d] = 1;
+                                                        // replace old drive info with current info
+
+                                                        d = key - '0';
+                                                        if (disks[d]->isOpen())
+                                                        {
+                                                                writeBlock(ofile, outBuf, outLength);
+                                                                outLength = 0;
+                                                                writeConfigLine(ofile, d);
+                                                                written[d] = 1;
+                                                        }
+                                                        state = STATE_SKIP_LINE;  // skip rest of line
                                                 }
-                                                state = STATE_SKIP_LINE;  // skip rest of line
-                                        }
-                                        else
-                                        {
-                                                ofile.write(key);
-                                                state = STATE_COPY_LINE;  // copy rest of line
-                                        }
-                                        break;
+                                                else
+                                                {
+                                                        outBuf[outLength++] = key;
+                                                        state = STATE_COPY_LINE;  // copy rest of line
+                                                }
+                                                break;
 
-                                case STATE_COPY_LINE:
-                                        ofile.write(key);   // then fall through
+                                        case STATE_COPY_LINE:
+                                                outBuf[outLength++] = key;   // then fall through
 
-                                case STATE_SKIP_LINE:
-                                        if (key == '\n')
-                                                state = STATE_NEWLINE;
-                                        break;
+                                        case STATE_SKIP_LINE:
+                                                if (key == '\n')
+                                                        state = STATE_NEWLINE;
+                                                break;
+                                }
+                                
+                                if (outLength == sizeof(outBuf))
+                                {
+                                        writeBlock(ofile, outBuf, outLength);
+                                        outLength = 0;
+                                }
                         }
                 }
+                writeBlock(ofile, outBuf, outLength);
 
                 // Now see if there are any mounted drives that aren't written
 
@@ -352,9 +552,7 @@ bool Disks::saveConfig(void)
                 {
                         if (written[d] == 0 && disks[d]->isOpen())
                         {
-                                ofile.print(d);
-                                ofile.print(":");
-                                ofile.println(disks[d]->getFilename());
+                                writeConfigLine(ofile, d);
                         }
                 }
         }
@@ -368,10 +566,59 @@ bool Disks::saveConfig(void)
 
 
 //=============================================================================
-// This is called to mount a disk image to one of the drives.  
+// Writes the config file line for one mounted drive, including the option
+// letters, so saving the configuration doesn't lose them.
+
+void Disks::writeConfigLine(File &ofile, int d)
+{
+        ofile.print(d);
+        if (disks[d]->isReadOnly())
+        {
+                ofile.print("R");
+        }
+        if (disks[d]->isLinkPrefetch())
+        {
+                ofile.print("L");
+        }
+        if (disks[d]->isPinSystem())
+        {
+                ofile.print("P");
+        }
+        if (disks[d]->isOverlay())
+        {
+                ofile.print("O");
+        }
+        if (disks[d]->getSectorSizeCode() != DEFAULT_SECTOR_CODE)
+        {
+                ofile.print("S");
+                ofile.print(disks[d]->getSectorSizeCode());
+        }
+        if (disks[d]->getFlushMode() != DEFAULT_FLUSH_MODE)
+        {
+                ofile.print("F");
+                ofile.print((int)disks[d]->getFlushMode());
+        }
+        if (disks[d]->getRamSectors() != 0)
+        {
+                ofile.print("M");
+                ofile.print(disks[d]->getRamSectors());
+        }
+        ofile.print(":");
+        ofile.println(disks[d]->getFilename());
+}
+
+
+
+
+//=============================================================================
+// This is called to mount a disk image to one of the drives.  The size code
+// gives the sector size of the image.  With overlay set, the image is used as
+// a read-only base and writes go to an overlay file.  If ramSectors isn't zero
+// that many sectors (or RAM_WHOLE_IMAGE) are kept in RAM, and the mount fails
+// if they don't fit.
 // Returns false on error
 
-bool Disks::mount(byte drive, char *filename, bool readOnly)
+bool Disks::mount(byte drive, char *filename, bool readOnly, byte sizeCode, bool overlay, unsigned ramSectors)
 {
         bool ret = false;    // assume no error
         
@@ -382,10 +629,37 @@ bool Disks::mount(byte drive, char *filename, bool readOnly)
         Serial.print("\"");
         if (readOnly)
                 Serial.print(" - read only");
+        else if (overlay)
+                Serial.print(" - overlay");
+        if (sizeCode != DEFAULT_SECTOR_CODE)
+        {
+                Serial.print(" - size code ");
+                Serial.print(sizeCode);
+        }
+        if (ramSectors == RAM_WHOLE_IMAGE)
+        {
+                Serial.print(" - in RAM");
+        }
+        else if (ramSectors != 0)
+        {
+                Serial.print(" - ");
+                Serial.print(ramSectors);
+                Serial.print(" sectors in RAM");
+        }
         Serial.println("");
         
-        disks[drive]->mount(filename, readOnly);
-        if (disks[drive]->isGood())
+        disks[drive]->mount(filename, readOnly, sizeCode, overlay);
+        if (disks[drive]->isGood() && ramSectors != 0 && !disks[drive]->loadRam(ramSectors))
+        {
+                // Refuse the whole mount rather than quietly running from
+                // the card.
+                
+                setError(disks[drive]->getError());
+                disks[drive]->unmount();
+                Serial.print(" - FAILED!  Error code ");
+                Serial.println(errorCode);
+        }
+        else if (disks[drive]->isGood())
         {
                 ret = true;
                 Serial.println(" - SUCCESS!");
@@ -403,6 +677,541 @@ bool Disks::mount(byte drive, char *filename, bool readOnly)
 
 
 
+//=============================================================================
+// Merges a drive's overlay into its base image, or throws the overlay away.
+// Both return false on error, with the reason in the error code.
+
+bool Disks::mergeOverlay(byte drive)
+{
+        if (!isDriveValid(drive))
+        {
+                setError(ERR_BAD_DRIVE);
+                return false;
+        }
+        if (!disks[drive]->mergeOverlay())
+        {
+                setError(disks[drive]->getError());
+                return false;
+        }
+        return true;
+}
+
+
+
+bool Disks::discardOverlay(byte drive)
+{
+        if (!isDriveValid(drive))
+        {
+                setError(ERR_BAD_DRIVE);
+                return false;
+        }
+        if (!disks[drive]->discardOverlay())
+        {
+                setError(disks[drive]->getError());
+                return false;
+        }
+        return true;
+}
+
+
+
+
+//=============================================================================
+// Converts between raw and sparse images.  A raw image becomes a sparse one
+// with the same name and a SPARSE_EXT extension, using the given sector size
+// code and fill value.  A sparse image (spotted by its header) becomes a raw
+// one with a .DSK extension.  Any existing file with the new name is
+// replaced, unless it's mounted.  Returns true on success, else the error
+// code says why.
+
+bool Disks::convert(char *filename, byte sizeCode, byte fill)
+{
+        char name[FNAME_SIZE + 1];
+        overlayHeader_t header;
+        bool ret;
+
+        commit();       // mounted images have to be up to date on the card
+
+        if (sizeCode < 1 || sizeCode > 4 || ::getSectorSize(sizeCode) > MAX_SECTOR_SIZE)
+        {
+                setError(ERR_BAD_SECTOR);
+                return false;
+        }
+        
+        File from = SD.open(filename, FILE_READ);
+        if (!from)
+        {
+                setError(ERR_FILE_NOT_FOUND);
+                return false;
+        }
+        bool sparse = (readBlock(from, (byte *)&header, sizeof(header)) == sizeof(header) &&
+                       header.magic == SPARSE_MAGIC);
+
+        strncpy(name, filename, FNAME_SIZE);
+        name[FNAME_SIZE] = '\0';
+        char *dot = strchr(name, '.');
+        if (dot == NULL)
+        {
+                dot = name + strlen(name);
+        }
+        strcpy(dot, sparse ? ".DSK" : "." SPARSE_EXT);
+
+        // Don't pull a file out from under a drive.
+        
+        bool busy = (strcmp(name, filename) == 0);
+        for (int d = 0; d < MAX_DISKS; d++)
+        {
+                if (disks[d]->isMounted() && strcmp(disks[d]->getFilename(), name) == 0)
+                {
+                        busy = true;
+                }
+        }
+        if (busy)
+        {
+                from.close();
+                setError(ERR_MOUNTED);
+                return false;
+        }
+
+        // Only whole sectors of a size a drive can use are converted.  A
+        // sparse header is checked the same way a mount checks it; a raw
+        // image with a partial sector at the end is refused rather than
+        // quietly losing it.
+
+        bool bad;
+        if (sparse)
+        {
+                byte code = 1;
+
+                while (code <= 4 && ::getSectorSize(code) != header.sectorSize)
+                {
+                        code++;
+                }
+                bad = (code > 4 || header.sectorSize > MAX_SECTOR_SIZE);
+        }
+        else
+        {
+                bad = (from.size() % ::getSectorSize(sizeCode) != 0);
+        }
+        if (bad)
+        {
+                Serial.print("Can't convert ");
+                Serial.print(filename);
+                Serial.println(", not whole sectors of a usable size");
+                from.close();
+                setError(ERR_BAD_SECTOR);
+                return false;
+        }
+
+        Serial.print("Converting ");
+        Serial.print(filename);
+        Serial.print(" to ");
+        Serial.println(name);
+        
+        SD.remove(name);
+        File to = SD.open(name, O_RDWR | O_CREAT);
+        if (!to)
+        {
+                from.close();
+                setError(ERR_WRITE_ERROR);
+                return false;
+        }
+
+        if (sparse)
+        {
+                ret = makeRaw(from, to, &header);
+        }
+        else
+        {
+                ret = makeSparse(from, to, ::getSectorSize(sizeCode), fill);
+        }
+        
+        Serial.print(from.size());
+        Serial.print(" bytes became ");
+        Serial.println(to.size());
+        from.close();
+        to.close();
+        
+        if (!ret)
+        {
+                Serial.println("Conversion failed");
+                SD.remove(name);
+                setError(ERR_WRITE_ERROR);
+        }
+        return ret;
+}
+
+
+
+
+//=============================================================================
+// Writes a sparse copy of a raw image.  The container is laid out the same
+// way Disk builds an overlay: the header chunk, the top-level table, then
+// index pages and data chunks as they're needed.  Sectors that are all the
+// fill value get nothing, other uniform sectors only an index entry.
+// convert() has already made sure the image is whole sectors.  Returns true
+// on success.
+
+static bool makeSparse(File &from, File &to, unsigned sectorSize, byte fill)
+{
+        static const byte zeros[16] = { 0 };
+        byte buf[MAX_SECTOR_SIZE];
+        overlayHeader_t header;
+        unsigned long sectors = from.size() / sectorSize;
+        unsigned perPage = sectorSize / 2;
+        unsigned long pages = (sectors + perPage - 1) / perPage;
+        unsigned long next = 1 + (pages * 2 + sectorSize - 1) / sectorSize;
+        unsigned long page = 0;
+        
+        // The header chunk and the empty top-level table.
+        
+        for (unsigned long pos = 0; pos < next * sectorSize; pos += sizeof(zeros))
+        {
+                if (!writeBlock(to, zeros, sizeof(zeros)))
+                {
+                        return false;
+                }
+        }
+        header.magic = SPARSE_MAGIC;
+        header.sectors = sectors;
+        header.sectorSize = sectorSize;
+        header.fill = fill;
+        if (!to.seek(0) || !writeBlock(to, (byte *)&header, sizeof(header)))
+        {
+                return false;
+        }
+
+        if (!from.seek(0))
+        {
+                return false;
+        }
+        for (unsigned long sector = 0; sector < sectors; sector++)
+        {
+                word entry = 0;
+                bool filled = true;
+                
+                if ((unsigned)readBlock(from, buf, sectorSize) != sectorSize)
+                {
+                        return false;
+                }
+                for (unsigned i = 1; filled && i < sectorSize; i++)
+                {
+                        filled = (buf[i] == buf[0]);
+                }
+                if (sector % perPage == 0)
+                {
+                        page = 0;       // new index page, not needed yet
+                }
+                if (filled && buf[0] == fill)
+                {
+                        continue;
+                }
+                if (next + 2 > FILL_SECTOR)
+                {
+                        Serial.println("Sparse image is full");
+                        return false;
+                }
+                
+                if (page == 0)
+                {
+                        page = next++;
+                        if (!to.seek(page * sectorSize))
+                        {
+                                return false;
+                        }
+                        for (unsigned i = 0; i < sectorSize; i += sizeof(zeros))
+                        {
+                                if (!writeBlock(to, zeros, sizeof(zeros)))
+                                {
+                                        return false;
+                                }
+                        }
+                        if (!putWord(to, sectorSize + (sector / perPage) * 2, page))
+                        {
+                                return false;
+                        }
+                }
+                
+                if (filled)
+                {
+                        entry = FILL_SECTOR | buf[0];
+                }
+                else
+                {
+                        entry = next++;
+                        if (!to.seek((unsigned long)entry * sectorSize) || !writeBlock(to, buf, sectorSize))
+                        {
+                                return false;
+                        }
+                }
+                if (!putWord(to, page * sectorSize + (sector % perPage) * 2, entry))
+                {
+                        return false;
+                }
+        }
+        to.flush();
+        return true;
+}
+
+
+
+
+//=============================================================================
+// Writes a raw copy of a sparse image.  convert() has already made sure the
+// header's sector size is one a drive can use.  Returns true on success.
+
+static bool makeRaw(File &from, File &to, overlayHeader_t *header)
+{
+        byte buf[MAX_SECTOR_SIZE];
+        unsigned sectorSize = header->sectorSize;
+        unsigned perPage = sectorSize / 2;
+        word page = 0;
+        
+        for (unsigned long sector = 0; sector < header->sectors; sector++)
+        {
+                word entry = 0;
+                
+                if (sector % perPage == 0 && !getWord(from, sectorSize + (sector / perPage) * 2, &page))
+                {
+                        return false;
+                }
+                if (page != 0 && !getWord(from, (unsigned long)page * sectorSize + (sector % perPage) * 2, &entry))
+                {
+                        return false;
+                }
+                
+                if (entry & FILL_SECTOR)
+                {
+                        memset(buf, entry & 0xff, sectorSize);
+                }
+                else if (entry == 0)
+                {
+                        memset(buf, header->fill, sectorSize);
+                }
+                else if (!from.seek((unsigned long)entry * sectorSize) ||
+                         (unsigned)readBlock(from, buf, sectorSize) != sectorSize)
+                {
+                        return false;
+                }
+                if (!writeBlock(to, buf, sectorSize))
+                {
+                        return false;
+                }
+        }
+        to.flush();
+        return true;
+}
+
+
+
+
+//=============================================================================
+// Read and write one little-endian word of a sparse image.  Both return true
+// on success.
+
+static bool getWord(File &file, unsigned long pos, word *value)
+{
+        byte buf[2];
+        
+        if (!file.seek(pos) || readBlock(file, buf, 2) != 2)
+        {
+                return false;
+        }
+        *value = buf[0] | (buf[1] << 8);
+        return true;
+}
+
+
+
+static bool putWord(File &file, unsigned long pos, word value)
+{
+        byte buf[2];
+
+        buf[0] = value & 0xff;
+        buf[1] = value >> 8;
+        return file.seek(pos) && writeBlock(file, buf, 2);
+}
+
+
+
+
+//=============================================================================
+// Creates a new image of tracks x sectors 256 byte sectors, filled with
+// fillPattern.  With flex set, the image also gets a FLEX layout: the SIR,
+// the directory chain on track 0 and every other sector on the free chain,
+// dated with date (month, day, year) if there is one.  Sectors are numbered
+// from 1 and every track has the same number of them.  An existing file is
+// replaced, unless it's mounted.
+//
+// The image is written a card block at a time, so every write hands the SD
+// library a whole block.  The block buffer is borrowed from the heap for the
+// format; if there isn't room for it, the image goes a sector at a time.
+// The file is not made contiguous: SD.h has no way to preallocate clusters,
+// so the image lands wherever the card's free clusters are and can end up
+// fragmented.  Returns true on success.
+
+bool Disks::format(char *filename, int tracks, int sectors, byte fillPattern, bool flex, byte *date)
+{
+        formatSpec_t spec;
+        unsigned long total = (unsigned long)tracks * sectors;
+        unsigned long start = millis();
+        bool ret = true;
+
+        if (tracks < 1 || tracks > 256 || (flex && tracks < 2))
+        {
+                setError(ERR_BAD_TRACK);
+                return false;
+        }
+        if (sectors < 1 || sectors > FLEX_MAX_SECTORS || (flex && sectors < FLEX_DIR_SECTOR))
+        {
+                setError(ERR_BAD_SECTOR);
+                return false;
+        }
+        for (int d = 0; d < MAX_DISKS; d++)
+        {
+                if (disks[d]->isMounted() && strcmp(disks[d]->getFilename(), filename) == 0)
+                {
+                        setError(ERR_MOUNTED);
+                        return false;
+                }
+        }
+
+        spec.tracks = tracks;
+        spec.sectors = sectors;
+        spec.fill = fillPattern;
+        spec.flex = flex;
+        memset(spec.label, 0, sizeof(spec.label));
+        for (int i = 0; i < 8 && filename[i] != '.' && filename[i] != '\0'; i++)
+        {
+                spec.label[i] = filename[i];
+        }
+        memset(spec.date, 0, sizeof(spec.date));
+        if (date != NULL)
+        {
+                memcpy(spec.date, date, sizeof(spec.date));
+        }
+
+        Serial.print("Formatting ");
+        Serial.print(filename);
+        Serial.print(", ");
+        Serial.print(tracks);
+        Serial.print(" tracks of ");
+        Serial.print(sectors);
+        Serial.println(flex ? " sectors, FLEX layout" : " sectors");
+        
+        SD.remove(filename);
+
+        byte sectorBuf[FLEX_SECTOR_SIZE];
+        byte *buf = NULL;
+        unsigned perWrite = CARD_BLOCK_SIZE / FLEX_SECTOR_SIZE;
+        
+        if (freeMemory() - CARD_BLOCK_SIZE >= SRAM_STACK)
+        {
+                buf = (byte *)malloc(CARD_BLOCK_SIZE);
+        }
+        if (buf == NULL)
+        {
+                buf = sectorBuf;
+                perWrite = 1;
+        }
+
+        File image = SD.open(filename, O_RDWR | O_CREAT);
+        if (!image)
+        {
+                ret = false;
+        }
+        for (unsigned long s = 0; ret && s < total; s += perWrite)
+        {
+                unsigned count = (total - s < perWrite) ? total - s : perWrite;
+                
+                for (unsigned i = 0; i < count; i++)
+                {
+                        formatSector(&spec, s + i, buf + i * FLEX_SECTOR_SIZE);
+                }
+                ret = writeBlock(image, buf, count * FLEX_SECTOR_SIZE);
+        }
+        image.close();
+        if (buf != sectorBuf)
+        {
+                free(buf);
+        }
+
+        if (!ret)
+        {
+                Serial.println("Format failed");
+                SD.remove(filename);
+                setError(ERR_WRITE_ERROR);
+                return false;
+        }
+        
+        Serial.print("Format took ");
+        Serial.print(millis() - start);
+        Serial.println(" ms");
+        return true;
+}
+
+
+
+
+//=============================================================================
+// Builds one sector of a new image.  index is the sector's position in the
+// image.  Without a FLEX layout every sector is fill.
+
+void Disks::formatSector(formatSpec_t *spec, unsigned long index, byte *buf)
+{
+        unsigned long total = (unsigned long)spec->tracks * spec->sectors;
+        byte track = index / spec->sectors;
+        byte sector = index % spec->sectors + FLEX_FIRST_SECTOR;
+        
+        if (!spec->flex)
+        {
+                memset(buf, spec->fill, FLEX_SECTOR_SIZE);
+                return;
+        }
+
+        memset(buf, 0, FLEX_SECTOR_SIZE);
+        if (track == 0 && sector == FLEX_SIR_SECTOR)
+        {
+                word freeCount = total - spec->sectors;
+                
+                memcpy(buf + SIR_LABEL, spec->label, sizeof(spec->label));
+                buf[SIR_FIRST_FREE] = 1;
+                buf[SIR_FIRST_FREE + 1] = FLEX_FIRST_SECTOR;
+                buf[SIR_LAST_FREE] = spec->tracks - 1;
+                buf[SIR_LAST_FREE + 1] = spec->sectors;
+                buf[SIR_FREE_COUNT] = freeCount >> 8;
+                buf[SIR_FREE_COUNT + 1] = freeCount & 0xff;
+                memcpy(buf + SIR_DATE, spec->date, sizeof(spec->date));
+                buf[SIR_MAX_TRACK] = spec->tracks - 1;
+                buf[SIR_MAX_SECTOR] = spec->sectors;
+        }
+        else if (track == 0 && sector >= FLEX_DIR_SECTOR)
+        {
+                // Empty directory sectors, linked to the end of the track.
+                
+                if (sector < spec->sectors)
+                {
+                        buf[0] = 0;
+                        buf[1] = sector + 1;
+                }
+        }
+        else if (track != 0)
+        {
+                // The free chain runs through the rest of the disk.  Bytes
+                // after the link and record number get the fill value.
+                
+                memset(buf + 4, spec->fill, FLEX_SECTOR_SIZE - 4);
+                if (index + 1 < total)
+                {
+                        buf[0] = (index + 1) / spec->sectors;
+                        buf[1] = (index + 1) % spec->sectors + FLEX_FIRST_SECTOR;
+                }
+        }
+}
+
+
+
+
 //=============================================================================
 // Unmount just one drive, the number being passed in.  Returns true on error
 // false if not.
@@ -427,6 +1236,9 @@ bool Disks::unmount(byte drive)
 bool Disks::read(byte drive, unsigned long offset, byte *buf)
 {
         bool ret = false;
+#ifdef LATENCY_HISTOGRAMS
+        unsigned long start = micros();
+#endif
         
         // Is the drive even mounted?
         
@@ -436,19 +1248,23 @@ bool Disks::read(byte drive, unsigned long offset, byte *buf)
                 {
                         ret = true;
                         errorCode = ERR_NONE;
+                        bytesToHost += disks[drive]->getSectorSize();
                 }
                 else    // error
                 {
                         Serial.println("**** read error ****");
                         Serial.flush();
-                        errorCode = disks[drive]->getError();
+                        setError(disks[drive]->getError());
                 }
         }
         else
         {
-                errorCode = ERR_NOT_MOUNTED;
+                setError(ERR_NOT_MOUNTED);
         }
 
+#ifdef LATENCY_HISTOGRAMS
+        latencyRecord(LAT_STORAGE, start);
+#endif
         return ret;
 }
 
@@ -463,6 +1279,9 @@ bool Disks::read(byte drive, unsigned long offset, byte *buf)
 bool Disks::write(byte drive, unsigned long offset, byte *buf)
 {
         bool ret = false;
+#ifdef LATENCY_HISTOGRAMS
+        unsigned long start = micros();
+#endif
         
         // Is the drive even mounted?
         
@@ -472,23 +1291,103 @@ bool Disks::write(byte drive, unsigned long offset, byte *buf)
                 {
                         ret = true;
                         errorCode = ERR_NONE;
+                        bytesFromHost += disks[drive]->getSectorSize();
                 }
                 else    // error
                 {
                         Serial.println("**** write error ****");
-                        errorCode = disks[drive]->getError();
+                        setError(disks[drive]->getError());
                 }
         }
         else
         {
-                errorCode = ERR_NOT_MOUNTED;
+                setError(ERR_NOT_MOUNTED);
         }
 
+#ifdef LATENCY_HISTOGRAMS
+        latencyRecord(LAT_STORAGE, start);
+#endif
         return ret;
 }
 
 
 
+//=============================================================================
+// Counts one failure with the given error code for the statistics.  Counts
+// stick at 0xffff.
+
+void Disks::countError(byte code)
+{
+        if (code >= ERR_FIRST_COUNTED && code <= ERR_LAST_COUNTED &&
+            errorCounts[code - ERR_FIRST_COUNTED] != 0xffff)
+        {
+                errorCounts[code - ERR_FIRST_COUNTED]++;
+        }
+}
+
+
+
+
+//=============================================================================
+// Returns how many times an error code has been seen, or 0 for codes that
+// aren't counted.
+
+word Disks::getErrorCount(byte code)
+{
+        if (code >= ERR_FIRST_COUNTED && code <= ERR_LAST_COUNTED)
+        {
+                return errorCounts[code - ERR_FIRST_COUNTED];
+        }
+        return 0;
+}
+
+
+
+
+//=============================================================================
+// Every sector request from the host carries a drive number and a sector size
+// code.  This makes sure the drive exists, is mounted, and uses that sector
+// size.  Returns true if the request is okay, else false with errorCode set.
+
+bool Disks::checkRequest(byte drive, byte sizeCode)
+{
+        if (!isDriveValid(drive))
+        {
+                setError(ERR_BAD_DRIVE);
+        }
+        else if (!disks[drive]->isMounted())
+        {
+                setError(ERR_NOT_MOUNTED);
+        }
+        else if (disks[drive]->getSectorSizeCode() != sizeCode)
+        {
+                setError(ERR_BAD_SECTOR);
+        }
+        else
+        {
+                return true;
+        }
+        return false;
+}
+
+
+
+
+//=============================================================================
+// The host passes the number of sectors per track with track/sector requests.
+// The drive needs it to turn FLEX links into file offsets.
+
+void Disks::setSectorsPerTrack(byte drive, byte spt)
+{
+        if (isDriveValid(drive))
+        {
+                disks[drive]->setSectorsPerTrack(spt);
+        }
+}
+
+
+
+
 //=============================================================================
 // Returns the status of a particular drive.
 
@@ -10,18 +10,48 @@
 #define __DISKS_H__
 
 #include "Disk.h"
+#include "Errors.h"
 #include "UserInt.h"
 
 
-// Sets the number of drives supported.  This depends on the OS, but FLEX
-// only supports four.
+// Pin used by the SD card
 
-#define MAX_DISKS  4
+#define SD_PIN  53
 
 
-// Pin used by the SD card
+// Where FLEX keeps things on a freshly formatted disk.  Track 0 holds the
+// boot sectors, the System Information Record and the directory chain; every
+// sector after that is on the free chain.  The SIR offsets are from the start
+// of the sector.
 
-#define SD_PIN  53
+#define FLEX_SECTOR_SIZE  256
+#define FLEX_MAX_SECTORS  255
+#define SIR_LABEL  0x10         // 11 bytes
+#define SIR_FIRST_FREE  0x1d    // track, sector
+#define SIR_LAST_FREE  0x1f     // track, sector
+#define SIR_FREE_COUNT  0x21    // big-endian word
+#define SIR_DATE  0x23          // month, day, year
+#define SIR_MAX_TRACK  0x26
+#define SIR_MAX_SECTOR  0x27
+
+// Everything needed to build any sector of a new image.
+
+typedef struct
+{
+        int tracks;
+        int sectors;            // per track
+        byte fill;
+        bool flex;              // build a FLEX layout
+        char label[11];
+        byte date[3];           // month, day, year
+} formatSpec_t;
+
+
+// Error codes from Errors.h that are counted for the statistics.
+
+#define ERR_FIRST_COUNTED  ERR_NOT_MOUNTED
+#define ERR_LAST_COUNTED  ERR_NO_MEMORY
+#define ERR_COUNTED  (ERR_LAST_COUNTED - ERR_FIRST_COUNTED + 1)
 
 
 // Reading the config file involves a very simple state machine.
@@ -31,6 +61,9 @@ typedef enum
 {
         FIRST_CHAR,
         AFTER_DRIVE,
+        AFTER_SIZE,
+        AFTER_FLUSH,
+        AFTER_RAM,
         WAIT_EOL,
         FILENAME,
 } configState_t;
@@ -48,21 +81,42 @@ class Disks
                 Disks(void);
                 ~Disks(void);
                 bool saveConfig(void);
-                bool mount(byte drive, char *filename, bool readOnly);
+                bool mount(byte drive, char *filename, bool readOnly, byte sizeCode = DEFAULT_SECTOR_CODE, bool overlay = false, unsigned ramSectors = 0);
                 bool unmount(byte drive);
+                bool mergeOverlay(byte drive);
+                bool discardOverlay(byte drive);
+                bool convert(char *filename, byte sizeCode, byte fill);
                 void mountDefaults(void) { mountDefaults(CONFIG_FILE_PRIMARY); }
                 void mountDefaults(int which);
                 void closeAll(void);
                 bool read(byte drive, unsigned long offset, byte *buf);
                 bool write(byte drive, unsigned long offset, byte *buf);
                 void poll(void);
+                bool idle(void);
+                bool commit(void);
                 byte getStatus(byte drive);
                 byte getErrorCode(void) { return errorCode; }
                 bool isDriveValid(byte drive) { return (drive < MAX_DISKS); }
+                bool checkRequest(byte drive, byte sizeCode);
+                unsigned getSectorSize(byte drive) { return disks[drive]->getSectorSize(); }
                 bool isReadOnly(byte drive) { return (disks[drive]->isReadOnly()); }
                 bool isMounted(byte drive) { return (disks[drive]->isMounted()); }
                 char *getFilename(byte drive) { return disks[drive]->getFilename(); }
-                bool format(char *filename, int tracks, int sectors, byte fillPattern);
+                unsigned long getReads(byte drive) { return disks[drive]->getReads(); }
+                unsigned long getWrites(byte drive) { return disks[drive]->getWrites(); }
+                unsigned long getReadAheadHits(byte drive) { return disks[drive]->getReadAheadHits(); }
+                byte getReadAheadDepth(byte drive) { return disks[drive]->getReadAheadDepth(); }
+                unsigned long getSeeksAvoided(byte drive) { return disks[drive]->getSeeksAvoided(); }
+                unsigned long getCacheHits(byte drive) { return disks[drive]->getCacheHits(); }
+                unsigned long getCacheMisses(byte drive) { return disks[drive]->getCacheMisses(); }
+                unsigned getRamSectors(byte drive) { return disks[drive]->getRamSectors(); }
+                void setSectorsPerTrack(byte drive, byte spt);
+                word getErrorCount(byte code);
+                unsigned long getBytesToHost(void) { return bytesToHost; }
+                unsigned long getBytesFromHost(void) { return bytesFromHost; }
+                void noteTransaction(unsigned long us) { if (us > maxTransaction) maxTransaction = us; }
+                unsigned long getMaxTransaction(void) { return maxTransaction; }
+                bool format(char *filename, int tracks, int sectors, byte fillPattern, bool flex = false, byte *date = NULL);
                 
         private:
                 Disk *disks[MAX_DISKS];
@@ -70,6 +124,13 @@ class Disks
                 void freeRam();
                 configState_t state;
                 bool readOnly;
+                bool linkPrefetch;
+                bool pinSystem;
+                bool useOverlay;
+                bool useRam;
+                unsigned ramSectors;
+                byte sizeCode;
+                flushMode_t flushMode;
                 char filename[13];
                 char *fnptr;
                 int drive;
@@ -79,7 +140,18 @@ class Disks
                 int whichConfigFile;
                 const char *configFileName;
                 
-                void setError(byte code) { errorCode = code; }
+                void setError(byte code) { errorCode = code; countError(code); }
+                void countError(byte code);
+
+                // Statistics for the host.  Sector data bytes moved in
+                // each direction, and the longest command, in microseconds.
+                
+                word errorCounts[ERR_COUNTED];
+                unsigned long bytesToHost;
+                unsigned long bytesFromHost;
+                unsigned long maxTransaction;
+                void writeConfigLine(File &ofile, int d);
+                void formatSector(formatSpec_t *spec, unsigned long index, byte *buf);
 };
 
 
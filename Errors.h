@@ -21,6 +21,7 @@
 #define ERR_WRITE_ERROR        18
 #define ERR_DEVICE_NOT_PRESENT 19
 #define ERR_NOT_IMPLEMENTED    20
+#define ERR_NO_MEMORY          21    // not enough RAM for a RAM-resident drive
 
 
 #endif  // __ERRORS_H__
@@ -19,7 +19,11 @@
 Event::Event(void)
 {
         type = EVT_NONE;
+        buffer = NULL;  // no buffer until attach() is called
+        size = 0;
         index = 0;    // no data in buffer yet
+        next = NULL;
+        inUse = false;
 }
 
 
@@ -35,6 +39,20 @@ Event::~Event(void)
 
 
 
+//=============================================================================
+// Gives the Event its buffer.  EventPool does this once for each of its
+// Events, and the buffer stays with the Event from then on.
+
+void Event::attach(byte *storage, unsigned length)
+{
+        buffer = storage;
+        size = length;
+        index = 0;
+}
+
+
+
+
 //=============================================================================
 // Some events have data associated with them, such as file contents, filenames,
 // etc.  This method is used to add a byte to the message contents of the
@@ -44,7 +62,7 @@ void Event::addByte(byte data)
 {
         // Make sure we aren't about to exceed the buffer size
         
-        if (index == BUFFER_SIZE)
+        if (index == size)
         {
         }
         else
@@ -55,6 +73,47 @@ void Event::addByte(byte data)
 
 
 
+//=============================================================================
+// Bulk version of addByte.  Appends count bytes to the message contents and
+// returns the number actually added, which is less than count only if the
+// buffer filled up.
+
+unsigned Event::addBytes(const byte *data, unsigned count)
+{
+        if (count > size - index)
+        {
+                count = size - index;
+        }
+        memcpy(buffer + index, data, count);
+        index += count;
+        return count;
+}
+
+
+
+
+//=============================================================================
+// Reserves count bytes at the end of the message contents and returns a
+// pointer to them so the caller can fill them in directly, such as reading
+// from a file straight into the Event.  If there isn't room for all of them,
+// only what fits is reserved; check getRoom() first.  Use truncate() to give
+// back any bytes that didn't get used.
+
+byte *Event::reserve(unsigned count)
+{
+        byte *ptr = buffer + index;
+        
+        if (count > size - index)
+        {
+                count = size - index;
+        }
+        index += count;
+        return ptr;
+}
+
+
+
+
 //=============================================================================
 // This cleans up an event by removing all old data, clearing the type, etc.
 
@@ -5,7 +5,8 @@
 //
 // Note that events have a buffer, and buffers consume the little bit of RAM
 // present in an Arduino, so minimize the number of Events allocated or else
-// memory might be a problem.
+// memory might be a problem.  They all come from the fixed set in EventPool,
+// which gives each one its buffer.
 //
 // Bob Applegate, K2UT - bob@corshamtech.com
 
@@ -51,25 +52,48 @@ typedef enum
         EVT_WRITE_BYTES,
         EVT_SAVE_CONFIG,
         EVT_SET_TIMER,
+        EVT_READ_MULTI_LONG,
+        EVT_WRITE_MULTI_LONG,
+        EVT_WRITE_MULTI_DATA,
+        EVT_OVERLAY,
+        EVT_CONVERT,
+        EVT_FORMAT,
+        EVT_GET_STATS,
+        EVT_STATS,
+        EVT_SET_HANDSHAKE,
 } EVENT_TYPE;
 
 
 
 
 
-// Events have a buffer for user data, so this sets the size.  Bear in mind that the
-// Arduino has very limited amounts of RAM, so don't make this any larger than
-// necessary!  Sectors are 256 bytes so thats the value I chose.
+// The largest sector size any drive can use.  Sector sizes of 128, 256, 512
+// and 1024 are all handled, but every Event and every cache entry in Disk is
+// this big, so only raise it if images with larger sectors are really going to
+// be mounted, and shrink the caches in Disk.h to make up for it.
 
-#define BUFFER_SIZE  (256+10)
+#define MAX_SECTOR_SIZE  256
+
+// Events have a buffer for user data, so this sets the size of the full sized
+// ones.  Bear in mind that the Arduino has very limited amounts of RAM, so
+// don't make this any larger than necessary!  It has to hold one sector plus
+// the command header.  EventPool also has small ones for short messages.
+
+#define BUFFER_SIZE  (MAX_SECTOR_SIZE+10)
 
 class Event
 {
         public:
                 Event(void);
                 ~Event(void);
+                void attach(byte *storage, unsigned length);
                 EVENT_TYPE getType(void) { return type; }
                 void addByte(byte data);
+                unsigned addBytes(const byte *data, unsigned count);
+                byte *reserve(unsigned count);
+                void truncate(unsigned length) { if (length < index) index = length; }
+                unsigned getRoom(void) { return size - index; }
+                unsigned getSize(void) { return size; }
                 unsigned getLength(void) { return index; }
                 byte *getData(void) { return buffer; }
                 void clearData(void) { index = 0; }
@@ -78,9 +102,13 @@ class Event
                 void clean(EVENT_TYPE atype);
         
         private:
+                friend class EventPool;
                 EVENT_TYPE type;
-                byte buffer[BUFFER_SIZE];
+                byte *buffer;
+                unsigned size;   // size of buffer
                 unsigned index;  // index into buffer
+                Event *next;     // next on the pool's free list
+                bool inUse;      // handed out by the pool
 };
 
 #endif    // __EVENT_H__
@@ -0,0 +1,132 @@
+//=============================================================================
+// FILE: EventPool.cpp
+//
+// The Events described in EventPool.h and their free lists.  There is only
+// one pool, which belongs to the Link.
+
+#include <Arduino.h>
+#include "EventPool.h"
+
+static Event smallEvents[SMALL_EVENTS];
+static Event largeEvents[LARGE_EVENTS];
+static byte smallBuffers[SMALL_EVENTS][SMALL_EVENT_SIZE];
+static byte largeBuffers[LARGE_EVENTS][BUFFER_SIZE];
+
+
+
+
+//=============================================================================
+// Gives every Event its buffer and puts them all on the free lists.
+
+EventPool::EventPool(void)
+{
+        memset(pools, 0, sizeof(pools));
+        pools[EVENT_SMALL].size = SMALL_EVENT_SIZE;
+        pools[EVENT_LARGE].size = BUFFER_SIZE;
+
+        for (byte i = 0; i < SMALL_EVENTS; i++)
+        {
+                smallEvents[i].attach(smallBuffers[i], SMALL_EVENT_SIZE);
+                smallEvents[i].next = pools[EVENT_SMALL].freeList;
+                pools[EVENT_SMALL].freeList = &smallEvents[i];
+        }
+        for (byte i = 0; i < LARGE_EVENTS; i++)
+        {
+                largeEvents[i].attach(largeBuffers[i], BUFFER_SIZE);
+                largeEvents[i].next = pools[EVENT_LARGE].freeList;
+                pools[EVENT_LARGE].freeList = &largeEvents[i];
+        }
+}
+
+
+
+
+//=============================================================================
+// Returns a free Event with room for at least need bytes, the smallest one
+// that will do.  If those are all in use a bigger one is used instead.
+// Returns NULL if there isn't one at all.
+
+Event *EventPool::get(unsigned need)
+{
+        for (byte c = 0; c < EVENT_CLASSES; c++)
+        {
+                if (pools[c].size < need)
+                {
+                        continue;
+                }
+
+                Event *eptr = pools[c].freeList;
+                if (eptr == NULL)
+                {
+                        pools[c].empty++;
+                        continue;
+                }
+
+                pools[c].freeList = eptr->next;
+                eptr->next = NULL;
+                eptr->inUse = true;
+                if (++pools[c].inUse > pools[c].highWater)
+                {
+                        pools[c].highWater = pools[c].inUse;
+                }
+                return eptr;
+        }
+
+        Serial.print("EventPool: no free Event for ");
+        Serial.print(need);
+        Serial.println(" bytes");
+        return NULL;
+}
+
+
+
+
+//=============================================================================
+// Puts an Event back on its free list.  Freeing one that is already free
+// would put it on the list twice, so that is caught and ignored.
+
+void EventPool::put(Event *eptr)
+{
+        if (eptr == NULL)
+        {
+                return;
+        }
+        if (!eptr->inUse)
+        {
+                Serial.println("EventPool: Event freed twice");
+                return;
+        }
+
+        byte c = (eptr >= smallEvents && eptr < smallEvents + SMALL_EVENTS) ? EVENT_SMALL : EVENT_LARGE;
+
+        eptr->inUse = false;
+        eptr->next = pools[c].freeList;
+        pools[c].freeList = eptr;
+        pools[c].inUse--;
+}
+
+
+
+
+//=============================================================================
+// Shows the counts for each size on the debug port.
+
+void EventPool::showStats(void)
+{
+        static const byte counts[EVENT_CLASSES] = { SMALL_EVENTS, LARGE_EVENTS };
+
+        for (byte c = 0; c < EVENT_CLASSES; c++)
+        {
+                Serial.print("Events of ");
+                Serial.print(pools[c].size);
+                Serial.print(" bytes: ");
+                Serial.print(pools[c].inUse);
+                Serial.print(" of ");
+                Serial.print(counts[c]);
+                Serial.print(" in use, most ");
+                Serial.print(pools[c].highWater);
+                Serial.print(", none free ");
+                Serial.print(pools[c].empty);
+                Serial.println(" times");
+        }
+}
@@ -0,0 +1,65 @@
+//=============================================================================
+// FILE: EventPool.h
+//
+// The fixed set of Events everything else borrows from.  They are globals
+// rather than coming from the heap, so the compiler counts them in the RAM it
+// reports and the heap can't fragment.  There are two sizes: small Events for
+// commands and replies that only carry a few bytes, like a status or one
+// directory entry, and full sized ones that hold a sector.  Each size has its
+// own free list, so getting or freeing an Event is a couple of pointer moves.
+//
+// The pool counts how many of each size are in use, the most that have been
+// in use at once, and how many times one was asked for when there were none
+// left, so the counts below can be checked against a real workload.  Send E
+// on the debug serial port to see them.
+
+#ifndef __EVENTPOOL_H__
+#define __EVENTPOOL_H__
+
+#include "Event.h"
+
+// A small Event has to hold the longest short reply, which is the version
+// string, or a directory entry with its filename.
+
+#define SMALL_EVENT_SIZE  32
+#define SMALL_EVENTS  4
+
+// Two of the full sized Events are the Link's stream buffers, which it keeps
+// for good, so this leaves one for sector commands.
+
+#define LARGE_EVENTS  3
+
+// The buffers, for the RAM sums in Disk.h.
+
+#define EVENT_POOL_BYTES  (SMALL_EVENTS * SMALL_EVENT_SIZE + LARGE_EVENTS * BUFFER_SIZE)
+
+enum
+{
+        EVENT_SMALL,
+        EVENT_LARGE,
+        EVENT_CLASSES,
+};
+
+class EventPool
+{
+        public:
+                EventPool(void);
+                Event *get(unsigned need);
+                void put(Event *eptr);
+                byte getInUse(byte sizeClass) { return pools[sizeClass].inUse; }
+                byte getHighWater(byte sizeClass) { return pools[sizeClass].highWater; }
+                unsigned getEmpty(byte sizeClass) { return pools[sizeClass].empty; }
+                void showStats(void);
+
+        private:
+                struct
+                {
+                        Event *freeList;
+                        unsigned size;          // buffer size of each Event
+                        byte inUse;
+                        byte highWater;         // most ever in use at once
+                        unsigned empty;         // times one was wanted but none were free
+                } pools[EVENT_CLASSES];
+};
+
+#endif  // __EVENTPOOL_H__
@@ -0,0 +1,152 @@
+//=============================================================================
+// FILE: Latency.cpp
+//
+// Keeps the latency histograms described in Latency.h.  The link tells this
+// which command it just received, and every time recorded after that is
+// charged to that command until the next one arrives.
+
+#include <Arduino.h>
+#include "Latency.h"
+
+#ifdef LATENCY_HISTOGRAMS
+
+// Command types with their own histogram, in slot order.  The last slot is
+// for everything else.
+
+static const EVENT_TYPE slotTypes[LATENCY_SLOTS - 1] =
+{
+        EVT_READ_SECTOR,
+        EVT_READ_SECTOR_LONG,
+        EVT_READ_MULTI_LONG,
+        EVT_WRITE_SECTOR,
+        EVT_WRITE_SECTOR_LONG,
+        EVT_WRITE_MULTI_LONG,
+        EVT_WRITE_MULTI_DATA,
+};
+
+// The names are only for the dump, so they stay in flash.  Each is a fixed
+// size array so it can be printed straight from there.
+
+static const char slotNames[LATENCY_SLOTS][18] PROGMEM =
+{
+        "READ_SECTOR",
+        "READ_SECTOR_LONG",
+        "READ_MULTI_LONG",
+        "WRITE_SECTOR",
+        "WRITE_SECTOR_LONG",
+        "WRITE_MULTI_LONG",
+        "WRITE_MULTI_DATA",
+        "other",
+};
+
+static const char phaseNames[LAT_PHASES][9] PROGMEM =
+{
+        "receive",
+        "storage",
+        "transmit",
+};
+
+// Counts stick at 0xffff rather than wrapping.
+
+static word histogram[LATENCY_SLOTS][LAT_PHASES][LATENCY_BUCKETS];
+static byte slot = LATENCY_SLOTS - 1;   // slot of the current command
+
+
+
+
+//=============================================================================
+// Called when a command has been received.  Times recorded from now on are
+// charged to it.
+
+void latencyCommand(EVENT_TYPE type)
+{
+        slot = 0;
+        while (slot < LATENCY_SLOTS - 1 && slotTypes[slot] != type)
+        {
+                slot++;
+        }
+}
+
+
+
+
+//=============================================================================
+// Records the time since start, a micros() value, for one phase of the
+// current command.
+
+void latencyRecord(byte phase, unsigned long start)
+{
+        unsigned long us = (micros() - start) / LATENCY_FIRST_US;
+        byte bucket = 0;
+
+        while (us != 0 && bucket < LATENCY_BUCKETS - 1)
+        {
+                us >>= 1;
+                bucket++;
+        }
+        if (histogram[slot][phase][bucket] != 0xffff)
+        {
+                histogram[slot][phase][bucket]++;
+        }
+}
+
+
+
+
+//=============================================================================
+// Prints every histogram with anything in it to the debug serial port.  Each
+// line is a command and phase, then the counts from the shortest bucket up.
+
+void latencyDump(void)
+{
+        Serial.print("Latency buckets (us): <");
+        Serial.print(LATENCY_FIRST_US);
+        for (byte b = 1; b < LATENCY_BUCKETS; b++)
+        {
+                Serial.print(" <");
+                Serial.print((unsigned long)LATENCY_FIRST_US << b);
+        }
+        Serial.println(" more");
+
+        for (byte s = 0; s < LATENCY_SLOTS; s++)
+        {
+                for (byte p = 0; p < LAT_PHASES; p++)
+                {
+                        unsigned long total = 0;
+
+                        for (byte b = 0; b < LATENCY_BUCKETS; b++)
+                        {
+                                total += histogram[s][p][b];
+                        }
+                        if (total == 0)
+                        {
+                                continue;
+                        }
+
+                        Serial.print((const __FlashStringHelper *)slotNames[s]);
+                        Serial.print(" ");
+                        Serial.print((const __FlashStringHelper *)phaseNames[p]);
+                        Serial.print(":");
+                        for (byte b = 0; b < LATENCY_BUCKETS; b++)
+                        {
+                                Serial.print(" ");
+                                Serial.print(histogram[s][p][b]);
+                        }
+                        Serial.println();
+                }
+        }
+}
+
+
+
+
+//=============================================================================
+// Clears all the histograms.
+
+void latencyReset(void)
+{
+        memset(histogram, 0, sizeof(histogram));
+        Serial.println("Latency histograms reset");
+}
+
+#endif  // LATENCY_HISTOGRAMS
@@ -0,0 +1,54 @@
+//=============================================================================
+// FILE: Latency.h
+//
+// Latency histograms for finding out where a transaction spends its time.
+// Each command is timed in three places: receiving it over the link, the
+// Disks::read or Disks::write call that does the work, and sending the
+// response.  Times go into log2 buckets, so recording one is a micros() call,
+// a few shifts and an increment.
+//
+// Send H on the debug serial port to dump them, R to reset them.
+
+#ifndef __LATENCY_H__
+#define __LATENCY_H__
+
+#include "Event.h"
+
+// Define to keep the histograms.  They take LATENCY_RAM bytes of globals,
+// which comes out of SRAM_RESERVED in Disk.h, so leave them off in builds
+// that need every byte, such as ones with RAM-resident drives.
+
+#undef LATENCY_HISTOGRAMS
+
+// Bucket 0 holds anything under LATENCY_FIRST_US microseconds, each bucket
+// after that twice as long as the one before, and the last one everything
+// longer.  With these values the last one starts at about 65 ms.
+
+#define LATENCY_FIRST_US  64
+#define LATENCY_BUCKETS  12
+
+typedef enum
+{
+        LAT_RECEIVE,
+        LAT_STORAGE,
+        LAT_TRANSMIT,
+        LAT_PHASES,
+} latencyPhase_t;
+
+// The sector commands each get a histogram, everything else shares one.
+
+#define LATENCY_SLOTS  8
+#define LATENCY_RAM  (LATENCY_SLOTS * LAT_PHASES * LATENCY_BUCKETS * 2)
+
+#ifdef LATENCY_HISTOGRAMS
+#define LATENCY_RAM_USED  LATENCY_RAM
+#else
+#define LATENCY_RAM_USED  0
+#endif
+
+void latencyCommand(EVENT_TYPE type);
+void latencyRecord(byte phase, unsigned long start);
+void latencyDump(void);
+void latencyReset(void);
+
+#endif  // __LATENCY_H__
@@ -43,7 +43,6 @@
 // This is NOT a complete implementation of the protocol!  Know problems
 // (but there are probably others):
 //
-//    * Only supports 256 byte sectors
 //    * RTC messages do not handle fields with values of FF nor the century byte
 //
 // 04/11/2014 - Bob Applegate, Corsham Technologies.  bob@corshamtech.com
@@ -83,6 +82,8 @@
 #include "RTC.h"
 #include "Errors.h"
 #include "SdFuncs.h"
+#include "Latency.h"
+#include "Trace.h"
 
 
 // Debugging options.  They usually produce lots of serial output so be careful what you turn on.
@@ -127,6 +128,20 @@ RTC *rtc;
 
 static unsigned long nextPoll;
 
+// State of a streamed multi-sector write.  The header sets it up, then each
+// sector that arrives is written and the result sent after the last one.
+
+static struct
+{
+        byte drive;
+        unsigned size;              // sector size in bytes
+        unsigned long sector;       // next sector to write
+        unsigned int remaining;     // sectors still to come
+        unsigned int index;         // index of the next sector in the run
+        byte error;                 // first error, ERR_NONE if none yet
+        byte failedIndex;           // index of the sector that failed
+} writeRun;
+
 // The pins used on the newer SD Shields.
 
 #define NEW_SHIELD_PIN  38
@@ -141,6 +156,30 @@ static unsigned long nextPoll;
 unsigned int timerValue = 0;
 unsigned int timerCount = 0;
 int pollCounter = 0;
+
+// The Arduino IDE makes prototypes for the functions in this file by itself,
+// but the PC build in host/ compiles it as plain C++, which needs them.
+
+int freeRam(const char *text);
+int freeMemory(void);
+static void serialCommand(void);
+static bool processEvent(Event *ep);
+static void readSector(Event *ep);
+static void readSectorLong(Event *ep);
+static void readMultiLong(Event *ep);
+static void writeSectorLong(Event *ep);
+static void startWriteRun(Event *ep);
+static void writeRunSector(Event *ep);
+static void writeSector(Event *ep);
+static void getDriveStatus(Event *ep);
+static void sendStats(Event *ep);
+static void addLong(Event *ep, unsigned long value);
+void sendMounted(Event *ep);
+void hexdump(unsigned char *ptr, unsigned int size);
+unsigned int getSectorSize(byte code);
+bool isNewBoard(void);
+void setTimerValue(unsigned char interval);
+bool debounceInputPin(int pin);
         
 
 
@@ -217,7 +256,24 @@ void setup()
         nextPoll = millis() + FAST_POLL_DELAY;
         pollCounter = 0;
 
-        freeRam("Initialization complete");
+        Serial.print("Read cache: ");
+        Serial.print(READ_CACHE_SECTORS);
+        Serial.print(" sectors, ");
+        Serial.print(READ_CACHE_IN);
+        Serial.print(" in the FIFO, up to ");
+        Serial.print(READ_CACHE_PINNED);
+        Serial.println(" pinned");
+
+        // Everything is allocated now, so whatever is left is the stack's.
+        // If that's less than Disk.h planned on, its numbers are off.
+        
+        int stackRoom = freeRam("Initialization complete");
+        if (stackRoom < SRAM_STACK)
+        {
+                Serial.print("Less stack than planned, add ");
+                Serial.print(SRAM_STACK - stackRoom);
+                Serial.println(" to SRAM_RESERVED in Disk.h");
+        }
 }
 
 
@@ -228,12 +284,29 @@ void setup()
 
 int freeRam(const char *text)
 {
-        extern int __heap_start, *__brkval;
-        int v;
-        int freemem = (int) &v - (__brkval == 0 ? (int) &__heap_start : (int) __brkval);
+        int freemem = freeMemory();
         Serial.print(text);
         Serial.print(" - Free memory: ");
         Serial.println(freemem);
+        return freemem;
+}
+
+
+
+
+//=============================================================================
+// Returns the number of bytes between the top of the heap and the stack.
+// Disk uses this to decide whether a RAM-resident drive will fit.
+
+int freeMemory(void)
+{
+#ifdef __AVR__
+        extern int __heap_start, *__brkval;
+        int v;
+        return (int) &v - (__brkval == 0 ? (int) &__heap_start : (int) __brkval);
+#else
+        return 4096;    // PC build: about what a Mega has left
+#endif
 }
 
 
@@ -252,7 +325,9 @@ void loop()
         if (link->poll())
         {
                 Event *ep = link->getEvent();  // this waits for an event
+                unsigned long start = micros();
                 bool deleteEvent = processEvent(ep);
+                disks->noteTransaction(micros() - start);
                 
                 // If the event isn't needed, delete it.  Some events need
                 // responses sent back and the event is re-used.
@@ -262,6 +337,16 @@ void loop()
                         link->freeAnEvent(ep);
                 }
         }
+        else if (link->isIdle())
+        {
+                // Nothing from the host right now, so let the disks do
+                // some read-ahead.
+                
+                disks->idle();
+#ifdef TRACE_COMMANDS
+                traceFlush();
+#endif
+        }
         
         // See if it's time to poll the various subsystems.  This is a
         // slow poll, so put high speed polling before this logic.
@@ -294,6 +379,7 @@ void loop()
         
                         uInt->poll();    // user interface
                         disks->poll();   // disk subsystem
+                        serialCommand(); // debug port
 
                         pollCounter = 0;
                 }
@@ -303,6 +389,70 @@ void loop()
 
 
 
+//=============================================================================
+// Handles single character commands typed on the debug serial port.
+
+static void serialCommand(void)
+{
+        if (!Serial.available())
+        {
+                return;
+        }
+        
+        switch (Serial.read())
+        {
+#ifdef LATENCY_HISTOGRAMS
+                case 'H':
+                case 'h':
+                        latencyDump();
+                        break;
+
+                case 'R':
+                case 'r':
+                        latencyReset();
+                        break;
+#endif
+
+#ifdef TRACE_COMMANDS
+                case 'T':
+                case 't':
+                        if (isTracing())
+                        {
+                                traceStop();
+                        }
+                        else
+                        {
+                                traceStart();
+                        }
+                        break;
+#endif
+
+                case 'E':
+                case 'e':
+                        link->showEventStats();
+                        break;
+
+                case '\r':
+                case '\n':
+                        break;
+                        
+                default:
+#ifdef LATENCY_HISTOGRAMS
+                        Serial.println("H = show latency histograms, R = reset them");
+#else
+                        Serial.println("Latency histograms aren't compiled in (see Latency.h)");
+#endif
+#ifdef TRACE_COMMANDS
+                        Serial.println("T = start/stop a command trace");
+#endif
+                        Serial.println("E = show how many Events are in use");
+                        break;
+        }
+}
+
+
+
+
 //=============================================================================
 // This processes an event that came from the host.  Returns a flag indicating
 // if the event should be freed or not.  If the event is reused, returns false.
@@ -312,6 +462,10 @@ static bool processEvent(Event *ep)
 {
         bool deleteEvent = false;    // assume event should not be deleted
         
+#ifdef TRACE_COMMANDS
+        traceCommand(ep);
+#endif
+
         // Now process the event based on the type.
                 
         switch (ep->getType())
@@ -320,8 +474,7 @@ static bool processEvent(Event *ep)
 #ifdef DEBUG_DIR
                         Serial.println("Got GET DIRECTORY");
 #endif
-                        link->freeAnEvent(ep);    // free it up so sendDirectory can use it
-                        sendDirectory();
+                        sendDirectory(ep);
                         break;
                                 
                 case EVT_TYPE_FILE:
@@ -342,16 +495,29 @@ static bool processEvent(Event *ep)
 
                 case EVT_GET_MOUNTED:
                         //Serial.println("Got request for mounted drives");
-                        link->freeAnEvent(ep); // free it up for sendMounted to use
-                        sendMounted();
+                        sendMounted(ep);
                         break;
                         
                 case EVT_MOUNT:
                 {
                         byte *bptr = ep->getData(); // pointer to data
                         byte drive = *bptr++;       // drive number
-                        byte readonly = *bptr++;    // read-only flag
-                        if (disks->mount(drive, (char *)bptr, readonly))
+                        byte flags = *bptr++;       // read-only flag and size code
+
+                        // Bit 0 is the read-only flag, bit 1 asks for an
+                        // overlay mount, bit 2 keeps the whole image in RAM.
+                        // Bits 4-6 can hold a sector size code; zero means
+                        // the default.
+                        
+                        bool readonly = flags & 0x01;
+                        bool overlay = flags & 0x02;
+                        unsigned ramSectors = (flags & 0x04) ? RAM_WHOLE_IMAGE : 0;
+                        byte sizeCode = (flags >> 4) & 0x07;
+                        if (sizeCode == 0)
+                        {
+                                sizeCode = DEFAULT_SECTOR_CODE;
+                        }
+                        if (disks->mount(drive, (char *)bptr, readonly, sizeCode, overlay, ramSectors))
                         {
                                 ep->clean(EVT_ACK);
                         }
@@ -373,6 +539,75 @@ static bool processEvent(Event *ep)
                         break;
                 }
                                 
+                case EVT_OVERLAY:   // drive number, then 0 = discard, 1 = merge
+                {
+                        byte *bptr = ep->getData();
+                        
+                        // Throwing the overlay away can't be undone, so an
+                        // action that isn't known does neither.
+                        
+                        if (bptr[1] != 0 && bptr[1] != 1)
+                        {
+                                ep->clean(EVT_NAK);
+                                ep->addByte(ERR_NOT_IMPLEMENTED);
+                        }
+                        else if (bptr[1] == 1 ? disks->mergeOverlay(bptr[0]) : disks->discardOverlay(bptr[0]))
+                        {
+                                ep->clean(EVT_ACK);
+                        }
+                        else
+                        {
+                                ep->clean(EVT_NAK);
+                                ep->addByte(disks->getErrorCode());
+                        }
+                        link->sendEvent(ep);
+                        break;
+                }
+
+                case EVT_FORMAT:    // tracks, sectors, fill, flags, filename
+                {
+                        byte *bptr = ep->getData();
+                        byte clock[8];
+                        byte date[3];
+                        int tracks = (bptr[0] == 0) ? 256 : bptr[0];
+                        
+                        // Bit 0 of the flags asks for a FLEX layout, which
+                        // is dated from the RTC.
+                        
+                        rtc->getClock(clock);
+                        date[0] = clock[0];     // month
+                        date[1] = clock[1];     // day
+                        date[2] = clock[3];     // year
+                        if (disks->format((char *)bptr + 4, tracks, bptr[1], bptr[2], bptr[3] & 0x01, date))
+                        {
+                                ep->clean(EVT_ACK);
+                        }
+                        else
+                        {
+                                ep->clean(EVT_NAK);
+                                ep->addByte(disks->getErrorCode());
+                        }
+                        link->sendEvent(ep);
+                        break;
+                }
+
+                case EVT_CONVERT:   // size code, fill value, filename
+                {
+                        byte *bptr = ep->getData();
+                        byte sizeCode = (bptr[0] == 0) ? DEFAULT_SECTOR_CODE : bptr[0];
+                        if (disks->convert((char *)bptr + 2, sizeCode, bptr[1]))
+                        {
+                                ep->clean(EVT_ACK);
+                        }
+                        else
+                        {
+                                ep->clean(EVT_NAK);
+                                ep->addByte(disks->getErrorCode());
+                        }
+                        link->sendEvent(ep);
+                        break;
+                }
+
                 case EVT_READ_SECTOR:
                         readSector(ep);
                         break;
@@ -380,6 +615,10 @@ static bool processEvent(Event *ep)
                 case EVT_READ_SECTOR_LONG:
                         readSectorLong(ep);
                         break;
+
+                case EVT_READ_MULTI_LONG:
+                        readMultiLong(ep);
+                        break;
                         
                 case EVT_WRITE_SECTOR:
                         writeSector(ep);
@@ -388,11 +627,27 @@ static bool processEvent(Event *ep)
                  case EVT_WRITE_SECTOR_LONG:
                         writeSectorLong(ep);
                         break;
+
+                case EVT_WRITE_MULTI_LONG:
+                        startWriteRun(ep);
+                        deleteEvent = true;
+                        break;
+
+                case EVT_WRITE_MULTI_DATA:
+                        // The Link owns the stream buffers, so the event is
+                        // not freed here.
+                        
+                        writeRunSector(ep);
+                        break;
                         
                 case EVT_GET_STATUS:
                         getDriveStatus(ep);
                         break;
                         
+                case EVT_GET_STATS:
+                        sendStats(ep);
+                        break;
+                        
                 case EVT_GET_VERSION:
                 {
                         ep->clean(EVT_VERSION_INFO);  // same event type but clear all other data
@@ -429,9 +684,11 @@ static bool processEvent(Event *ep)
                         break;
 
                 case EVT_DONE:
-                        // Close any open file.
+                        // Close any open file, and commit any batches of
+                        // cached writes.
 
                         closeFiles();
+                        disks->commit();
                         deleteEvent = true;
                         break;
 
@@ -459,6 +716,22 @@ static bool processEvent(Event *ep)
                         link->sendEvent(ep);
                         break;
 
+                case EVT_SET_HANDSHAKE:
+                        // The ACK goes out with the old handshake and the
+                        // Link switches after it.
+                        
+                        if (link->setHandshake(ep->getData()[0]))
+                        {
+                                ep->clean(EVT_ACK);
+                        }
+                        else
+                        {
+                                ep->clean(EVT_NAK);
+                                ep->addByte(ERR_NOT_IMPLEMENTED);
+                        }
+                        link->sendEvent(ep);
+                        break;
+
                 case EVT_SET_TIMER:
                 {
                         if (isNewBoard())
@@ -508,21 +781,29 @@ static void readSector(Event *ep)
 {
         byte *bptr = ep->getData();  // start of arguments
         byte drive = *bptr++;
-        byte sectorSize = *bptr++;    // note used for now
+        byte sectorSize = *bptr++;    // size code
         unsigned long track = (unsigned long)(*bptr++);
         //Serial.println(*bptr);
         unsigned long sector = (unsigned long)(*bptr++);
         unsigned long sectorsPerTrack = (unsigned long)(*bptr++);
         
-        // NOTE: Need to add checks for valid drive, track, sector, etc
+        // NOTE: Need to add checks for valid track, sector, etc
+
+        if (!disks->checkRequest(drive, sectorSize))
+        {
+                ep->clean(EVT_NAK);
+                ep->addByte(disks->getErrorCode());
+                link->sendEvent(ep);
+                return;
+        }
         
         // Compute the offset.  Very simple offset calculation.
         
-        unsigned long offset = ((track * sectorsPerTrack) + sector) * SECTOR_SIZE;        
+        unsigned long offset = ((track * sectorsPerTrack) + sector) * disks->getSectorSize(drive);
         
         // Now prepare the event for sending back the data.  Same event type,
-        // but get rid of the old data and replace with exactly SECTOR_SIZE
-        // number of bytes.
+        // but get rid of the old data and replace with exactly one sector's
+        // worth of bytes.
 
 #ifdef DEBUG_SECTOR_READ
         Serial.print("readSector drive ");
@@ -539,8 +820,10 @@ static void readSector(Event *ep)
         Serial.print(" first two: ");
 #endif  // DEBUG_SECTOR_READ
 
+        disks->setSectorsPerTrack(drive, sectorsPerTrack);
+
         byte *ptr = ep->getData();
-        *ptr++ = 2;      // sector size 256 bytes
+        *ptr++ = sectorSize;      // sector size code
         ep->clean(EVT_READ_SECTOR);  // same event type but clear all other data
         if (disks->read(drive, offset, ptr) == false)
         {
@@ -573,7 +856,7 @@ static void readSectorLong(Event *ep)
 {
         byte *bptr = ep->getData();  // start of arguments
         byte drive = *bptr++;
-        byte sectorSize = *bptr++;    // note used for now
+        byte sectorSize = *bptr++;    // size code
         unsigned long sector = (unsigned long)(*bptr++);
         sector <<= 8;
         sector |= (unsigned long)(*bptr++);
@@ -582,15 +865,23 @@ static void readSectorLong(Event *ep)
         sector <<= 8;
         sector |= (unsigned long)(*bptr++);
         
-        // NOTE: Need to add checks for valid drive, sector, etc
+        // NOTE: Need to add checks for valid sector, etc
+
+        if (!disks->checkRequest(drive, sectorSize))
+        {
+                ep->clean(EVT_NAK);
+                ep->addByte(disks->getErrorCode());
+                link->sendEvent(ep);
+                return;
+        }
         
         // Compute the offset.  Very simple offset calculation.
         
-        unsigned long offset = sector * SECTOR_SIZE;        
+        unsigned long offset = sector * disks->getSectorSize(drive);
         
         // Now prepare the event for sending back the data.  Same event type,
-        // but get rid of the old data and replace with exactly SECTOR_SIZE
-        // number of bytes.
+        // but get rid of the old data and replace with exactly one sector's
+        // worth of bytes.
 
 #ifdef DEBUG_SECTOR_READ
         Serial.print("readSectorLong drive ");
@@ -604,7 +895,7 @@ static void readSectorLong(Event *ep)
 #endif  // DEBUG_SECTOR_READ
 
         byte *ptr = ep->getData();
-        *ptr++ = 2;      // sector size 256 bytes
+        *ptr++ = sectorSize;      // sector size code
         ep->clean(EVT_READ_SECTOR);  // same event type but clear all other data
         if (disks->read(drive, offset, ptr) == false)
         {
@@ -627,6 +918,83 @@ static void readSectorLong(Event *ep)
 
 
 
+//=============================================================================
+// This handles a request to read a run of consecutive sectors in one
+// transaction.  The data structure contains a standard header with seven bytes
+// of data: (1) Drive number, 0 to X, (2) sector size (coded), then a four byte
+// starting sector number with the MSB first, and (7) the number of sectors,
+// 1-255 or 0 for 256.
+//
+// The sectors are sent back to back, each as a normal sector data message,
+// without the host sending another command.  If a sector can't be read, a NAK
+// with the error code is sent in its place and the transaction ends there.
+//
+// Two buffers take turns, so when the Link can send in the background the
+// next sector is read from the card while the host takes the last one.
+
+static void readMultiLong(Event *ep)
+{
+        byte *bptr = ep->getData();  // start of arguments
+        byte drive = *bptr++;
+        byte sectorSize = *bptr++;    // size code
+        unsigned long sector = (unsigned long)(*bptr++);
+        sector <<= 8;
+        sector |= (unsigned long)(*bptr++);
+        sector <<= 8;
+        sector |= (unsigned long)(*bptr++);
+        sector <<= 8;
+        sector |= (unsigned long)(*bptr++);
+        unsigned int count = *bptr++;
+        if (count == 0)
+        {
+                count = 256;
+        }
+
+#ifdef DEBUG_SECTOR_READ
+        Serial.print("readMultiLong drive ");
+        Serial.print(drive);
+        Serial.print(", sector 0x");
+        Serial.print(sector, HEX);
+        Serial.print(", count ");
+        Serial.println(count);
+#endif  // DEBUG_SECTOR_READ
+
+        if (!disks->checkRequest(drive, sectorSize))
+        {
+                ep->clean(EVT_NAK);
+                ep->addByte(disks->getErrorCode());
+                link->sendEvent(ep);
+                return;
+        }
+
+        unsigned size = disks->getSectorSize(drive);
+        Event *buffers[2] = { ep, link->getSpareEvent() };
+        byte fill = 0;
+        
+        link->startResponse();
+        while (count--)
+        {
+                Event *bp = buffers[fill];
+                byte *ptr = bp->getData();
+                *ptr++ = sectorSize;      // sector size code
+                bp->clean(EVT_READ_SECTOR);
+                if (disks->read(drive, sector * size, ptr) == false)
+                {
+                        bp->clean(EVT_NAK);  // send error status and stop
+                        bp->addByte(disks->getErrorCode());
+                        link->sendResponsePart(bp);
+                        break;
+                }
+                link->queueResponsePart(bp);
+                fill ^= 1;
+                sector++;
+        }
+        link->endResponse(ep);
+}
+
+
+
+
 //=============================================================================
 // This handles a request to write a disk sector using only a long sector
 // number.  The data structure contains a standard header with six bytes of 
@@ -641,7 +1009,7 @@ static void writeSectorLong(Event *ep)
         
         byte *bptr = ep->getData();  // start of arguments
         byte drive = *bptr++;
-        byte sectorSize = *bptr++;    // note used for now
+        byte sectorSize = *bptr++;    // size code
         unsigned long sector = (unsigned long)(*bptr++);
         sector <<= 8;
         sector |= (unsigned long)(*bptr++);
@@ -650,11 +1018,19 @@ static void writeSectorLong(Event *ep)
         sector <<= 8;
         sector |= (unsigned long)(*bptr++);
         
-        // NOTE: Need to add checks for valid drive, sector, etc
+        // NOTE: Need to add checks for valid sector, etc
+
+        if (!disks->checkRequest(drive, sectorSize))
+        {
+                ep->clean(EVT_NAK);
+                ep->addByte(disks->getErrorCode());
+                link->sendEvent(ep);
+                return;
+        }
         
         // Compute the offset.  Very simple offset calculation.
         
-        unsigned long offset = sector * SECTOR_SIZE;        
+        unsigned long offset = sector * disks->getSectorSize(drive);
         
         // Dump the data
 
@@ -685,6 +1061,103 @@ static void writeSectorLong(Event *ep)
 
 
 
+//=============================================================================
+// This handles the header of a streamed write, which is the same as for
+// readMultiLong(): (1) Drive number, (2) sector size (coded), a four byte
+// starting sector number with the MSB first, and (7) the number of sectors,
+// 1-255 or 0 for 256.  The sector data follows as separate events.
+
+static void startWriteRun(Event *ep)
+{
+        byte *bptr = ep->getData();  // start of arguments
+        writeRun.drive = *bptr++;
+        byte sectorSize = *bptr++;    // size code
+        unsigned long sector = (unsigned long)(*bptr++);
+        sector <<= 8;
+        sector |= (unsigned long)(*bptr++);
+        sector <<= 8;
+        sector |= (unsigned long)(*bptr++);
+        sector <<= 8;
+        sector |= (unsigned long)(*bptr++);
+        writeRun.sector = sector;
+        writeRun.remaining = *bptr++;
+        if (writeRun.remaining == 0)
+        {
+                writeRun.remaining = 256;
+        }
+        writeRun.index = 0;
+        writeRun.error = ERR_NONE;
+        writeRun.failedIndex = 0;
+
+        // A bad request still has to soak up all the data, so just note the
+        // error and report it at the end.
+        
+        if (!disks->checkRequest(writeRun.drive, sectorSize))
+        {
+                writeRun.error = disks->getErrorCode();
+        }
+        else
+        {
+                writeRun.size = disks->getSectorSize(writeRun.drive);
+        }
+
+#ifdef LOG_WRITE
+        Serial.print("startWriteRun drive ");
+        Serial.print(writeRun.drive);
+        Serial.print(", sector 0x");
+        Serial.print(sector, HEX);
+        Serial.print(", count ");
+        Serial.println(writeRun.remaining);
+#endif  // LOG_WRITE
+}
+
+
+
+
+//=============================================================================
+// Handles one sector of a streamed write.  Once something fails, the rest of
+// the run is received but not written.  After the last sector, a single ACK
+// is sent, or a NAK with the error code followed by the index (zero based)
+// of the first sector that failed.  The reply goes out in the last sector's
+// stream buffer, which is finished with by then, so it can't fail for want
+// of an Event.  The Link keeps its stream buffers, so it isn't freed.
+
+static void writeRunSector(Event *ep)
+{
+        if (writeRun.error == ERR_NONE)
+        {
+                if (!disks->write(writeRun.drive, writeRun.sector * writeRun.size, ep->getData()))
+                {
+                        writeRun.error = disks->getErrorCode();
+                        writeRun.failedIndex = writeRun.index;
+                        Serial.print("got write error: ");
+                        Serial.println(writeRun.error);
+                }
+        }
+        writeRun.sector++;
+        writeRun.index++;
+
+        if (--writeRun.remaining == 0)
+        {
+                if (writeRun.error == ERR_NONE)
+                {
+                        ep->clean(EVT_ACK);
+                }
+                else
+                {
+                        ep->clean(EVT_NAK);
+                        ep->addByte(writeRun.error);
+                        ep->addByte(writeRun.failedIndex);
+                }
+                link->startResponse();
+                link->sendResponsePart(ep);
+                link->endResponse(NULL);
+        }
+}
+
+
+
+
 //=============================================================================
 // This handles a request to write a disk sector using tracks and sectors.  The
 // data structure contains a standard header with five bytes of data: (1) Drive
@@ -699,18 +1172,26 @@ static void writeSector(Event *ep)
         
         byte *bptr = ep->getData();  // start of arguments
         byte drive = *bptr++;
-        byte sectorSize = *bptr++;    // note used for now
+        byte sectorSize = *bptr++;    // size code
         unsigned long track = (unsigned long)(*bptr++);
         unsigned long sector = (unsigned long)(*bptr++);
         unsigned long sectorsPerTrack = (unsigned long)(*bptr++);
 
         // bptr is now pointing to the start of the user data to be written.
         
-        // NOTE: Need to add checks for valid drive, sector, etc
+        // NOTE: Need to add checks for valid sector, etc
+
+        if (!disks->checkRequest(drive, sectorSize))
+        {
+                ep->clean(EVT_NAK);
+                ep->addByte(disks->getErrorCode());
+                link->sendEvent(ep);
+                return;
+        }
         
         // Compute the offset.  Very simple offset calculation.
         
-        unsigned long offset = ((track * sectorsPerTrack) + sector) * SECTOR_SIZE;
+        unsigned long offset = ((track * sectorsPerTrack) + sector) * disks->getSectorSize(drive);
         
         // Dump the data
 
@@ -728,6 +1209,7 @@ static void writeSector(Event *ep)
         Serial.println(offset & 0xffff, HEX);
 #endif  // LOG_WRITE
 
+        disks->setSectorsPerTrack(drive, sectorsPerTrack);
         if (disks->write(drive, offset, bptr))
         {
                 ep->clean(EVT_ACK);
@@ -764,17 +1246,76 @@ static void getDriveStatus(Event *ep)
 
 
 
+
 //=============================================================================
-// Send a list of all mounted drives
+// Sends the statistics block to the host.  All values are big-endian, like
+// the rest of the protocol:
+//
+//    1 byte   block version (1)
+//    1 byte   number of drives, then for each drive:
+//    4 bytes     sectors read since the image was mounted
+//    4 bytes     sectors written
+//    4 bytes     cache hits
+//    1 byte   first error code counted, 1 byte number of codes, then for
+//             each one:
+//    2 bytes     times that error was returned
+//    4 bytes  sector data bytes sent to the host
+//    4 bytes  sector data bytes received from the host
+//    4 bytes  longest time, in microseconds, spent handling one command and
+//             sending its response
+
+static void sendStats(Event *ep)
+{
+        ep->clean(EVT_STATS);
+        ep->addByte(1);
+        ep->addByte(MAX_DISKS);
+        for (byte drive = 0; drive < MAX_DISKS; drive++)
+        {
+                addLong(ep, disks->getReads(drive));
+                addLong(ep, disks->getWrites(drive));
+                addLong(ep, disks->getCacheHits(drive));
+        }
+        ep->addByte(ERR_FIRST_COUNTED);
+        ep->addByte(ERR_COUNTED);
+        for (byte code = ERR_FIRST_COUNTED; code <= ERR_LAST_COUNTED; code++)
+        {
+                word count = disks->getErrorCount(code);
+                ep->addByte(count >> 8);
+                ep->addByte(count & 0xff);
+        }
+        addLong(ep, disks->getBytesToHost());
+        addLong(ep, disks->getBytesFromHost());
+        addLong(ep, disks->getMaxTransaction());
+        link->sendEvent(ep);
+}
+
+
+
+
+//=============================================================================
+// Adds a big-endian long to an event.
+
+static void addLong(Event *ep, unsigned long value)
+{
+        ep->addByte(value >> 24);
+        ep->addByte((value >> 16) & 0xff);
+        ep->addByte((value >> 8) & 0xff);
+        ep->addByte(value & 0xff);
+}
+
+
+
+//=============================================================================
+// Send a list of all mounted drives.  Like the directory, the whole list
+// goes out as one response in the command's own Event, which is freed after.
 
-void sendMounted(void)
+void sendMounted(Event *eptr)
 {
-        Event *eptr;
         char *cptr;
         
+        link->startResponse();
         for (int i = 0; i < MAX_DISKS; i++)
         {
-                eptr = link->getAnEvent();
                 eptr->clean(EVT_MOUNTED);
 
                 // add the info about this mounted drive
@@ -787,11 +1328,7 @@ void sendMounted(void)
                         eptr->addByte(disks->isReadOnly(i));
 
                         cptr = disks->getFilename(i);
-                        while (*cptr)
-                        {
-                                eptr->addByte(*cptr++);
-                        }
-                        eptr->addByte(0);
+                        eptr->addBytes((byte *)cptr, strlen(cptr) + 1);  // including the null
                 }
                 else  // not mounted so indicate so
                 {
@@ -799,14 +1336,14 @@ void sendMounted(void)
                         eptr->addByte(0);
                 }
                         
-                link->sendEvent(eptr);
+                link->sendResponsePart(eptr);
         }
 
         // Indicate all the drives were sent
         
-        eptr = link->getAnEvent();
         eptr->clean(EVT_DIR_END);
-        link->sendEvent(eptr);
+        link->sendResponsePart(eptr);
+        link->endResponse(eptr);
 }
 
 
@@ -19,14 +19,13 @@ static File myFile;
 
 
 //=============================================================================
-// This sends a directory to the host.  On entry, it is assumed there is at
-// least one Event available.  Ie, free it before calling this.  This sends
-// only file names at the top level, not directories, and it does not
-// recurse.
+// This sends a directory to the host, one message per file, all in the
+// command's own Event as a single response, so it never needs another Event
+// from the pool.  This sends only file names at the top level, not
+// directories, and it does not recurse.  The Event is freed when it's done.
 
-void sendDirectory()
+void sendDirectory(Event *eptr)
 {
-        Event *eptr;
 #ifdef USE_SDFAT
         SdFat sd;
         SdFile file;
@@ -58,6 +57,7 @@ void sendDirectory()
         File entry;
 #endif
                                 
+        link->startResponse();
         while (go_on)
         {
 #ifdef USE_SDFAT
@@ -76,15 +76,9 @@ void sendDirectory()
                                 byte *bptr = (byte *)name;
                                 if (*bptr != '_') // filenames starting with underscore are deleted
                                 {
-                                        eptr = link->getAnEvent();
                                         eptr->clean(EVT_DIR_INFO);    // this is a directory entry
-
-                                        while (*bptr)
-                                        {
-                                                eptr->addByte(*bptr++);
-                                        }
-                                        eptr->addByte(0);    // terminate the name
-                                        link->sendEvent(eptr);
+                                        eptr->addBytes(bptr, strlen(name) + 1);  // including the null
+                                        link->sendResponsePart(eptr);
                                 }
                         }
                         file.close();
@@ -108,18 +102,13 @@ void sendDirectory()
                         byte *bptr = (byte *)(entry.name());
                         if (*bptr != '_') // filenames starting with underscore are deleted
                         {
-                                eptr = link->getAnEvent();
                                 eptr->clean(EVT_DIR_INFO);    // this is a directory entry
 #ifdef DEBUG_DIR
                                 Serial.print("   ");
                                 Serial.println(entry.name());
 #endif
-                                while (*bptr)
-                                {
-                                        eptr->addByte(*bptr++);
-                                }
-                                eptr->addByte(0);    // terminate the name
-                                link->sendEvent(eptr);
+                                eptr->addBytes(bptr, strlen((char *)bptr) + 1);  // including the null
+                                link->sendResponsePart(eptr);
                         }
                 }
                 entry.close();
@@ -128,10 +117,11 @@ void sendDirectory()
         dir.close();
 #endif
         
-        // Send an event letting the host know the directory is done
+        // Let the host know the directory is done
         
         eptr->clean(EVT_DIR_END);
-        link->sendEvent(eptr);
+        link->sendResponsePart(eptr);
+        link->endResponse(eptr);
 }
 
 
@@ -194,14 +184,14 @@ void nextDataBlock(Event *ep)
         // go back and put the actual length into the buffer.
                            
         ep->addByte(0);    // length is first
-                                
-        byte actualCount = 0;
 
-        while (myFile.available() && actualCount < length)
-        {
-                ep->addByte(myFile.read());
-                actualCount++;
-        }
+        // Read the whole block straight into the Event, then give back
+        // whatever wasn't used.
+        
+        byte *dptr = ep->reserve(length);
+        int got = readBlock(myFile, dptr, length);
+        byte actualCount = (got > 0) ? got : 0;
+        ep->truncate(actualCount + 1);
                                 
         // Now go back and put in the actual length
                                 
@@ -311,3 +301,50 @@ void closeFiles(void)
 {
         myFile.close();   // be sure it's closed
 }
+
+
+
+
+//=============================================================================
+// Reads up to count bytes from the current position of the file into buf in
+// one call to the SD library.  Returns the number of bytes read, which is
+// less than count at the end of the file, or -1 on error.
+
+int readBlock(File &file, byte *buf, unsigned count)
+{
+        return file.read(buf, count);
+}
+
+
+
+
+//=============================================================================
+// Writes count bytes from buf to the current position of the file in one
+// call.  Returns true if they were all written.
+
+bool writeBlock(File &file, const byte *buf, unsigned count)
+{
+        return file.write(buf, count) == count;
+}
+
+
+
+
+//=============================================================================
+// Copies everything from the current position of one file to the end of
+// another, a chunk at a time.  Returns true on success.
+
+bool copyFile(File &from, File &to)
+{
+        byte buffer[COPY_CHUNK_SIZE];
+        int got;
+        
+        while ((got = readBlock(from, buffer, sizeof(buffer))) > 0)
+        {
+                if (!writeBlock(to, buffer, got))
+                {
+                        return false;
+                }
+        }
+        return got == 0;
+}
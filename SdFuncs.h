@@ -7,13 +7,22 @@
 #ifndef __SDFUNCS_H__
 #define __SDFUNCS_H__
 
-void sendDirectory();
+void sendDirectory(Event *ep);
 void openFileForRead(Event *ep);
 void nextDataBlock(Event *ep);
 void openFileForWrite(Event *ep);
 void writeBytes(Event *ep);
 void closeFiles(void);
 
+// Block I/O helpers.  Always move data through these rather than one byte at
+// a time; every call into the SD library has a fair amount of overhead.
+
+#define COPY_CHUNK_SIZE  64    // stack buffer used for copying files
+
+int readBlock(File &file, byte *buf, unsigned count);
+bool writeBlock(File &file, const byte *buf, unsigned count);
+bool copyFile(File &from, File &to);
+
 #endif  // __SDFUNCS_H__
 
 
@@ -0,0 +1,203 @@
+//=============================================================================
+// FILE: Trace.cpp
+//
+// The command trace recorder described in Trace.h.  processEvent hands every
+// command to traceCommand, which decodes it into the RAM buffer.  The buffer
+// goes to the card from traceFlush when the link is idle, or right away if
+// it fills up first.
+
+#include <Arduino.h>
+#include <SPI.h>
+#include <SD.h>
+#include "Trace.h"
+
+#ifdef TRACE_COMMANDS
+
+static File traceFile;
+static bool tracing = false;
+static traceRecord_t buffer[TRACE_BUFFER];
+static byte used = 0;           // records in the buffer
+static unsigned long dropped;   // records lost to write errors
+
+static unsigned long getLong(byte *bptr);
+
+
+
+
+//=============================================================================
+// Starts a new trace, replacing any old one.  Returns false if the file
+// can't be created.
+
+bool traceStart(void)
+{
+        unsigned long magic = TRACE_MAGIC;
+
+        if (tracing)
+        {
+                return true;
+        }
+
+        SD.remove(TRACE_FILE);
+        traceFile = SD.open(TRACE_FILE, O_RDWR | O_CREAT);
+        if (!traceFile)
+        {
+                Serial.println("Can't create " TRACE_FILE);
+                return false;
+        }
+        traceFile.write((byte *)&magic, sizeof(magic));
+        used = 0;
+        dropped = 0;
+        tracing = true;
+        Serial.println("Tracing to " TRACE_FILE);
+        return true;
+}
+
+
+
+
+//=============================================================================
+// Writes out anything still buffered and closes the trace file.
+
+void traceStop(void)
+{
+        if (!tracing)
+        {
+                return;
+        }
+
+        traceFlush();
+        tracing = false;
+        Serial.print("Trace stopped, ");
+        Serial.print(traceFile.size());
+        Serial.print(" bytes");
+        if (dropped)
+        {
+                Serial.print(", ");
+                Serial.print(dropped);
+                Serial.print(" records lost");
+        }
+        Serial.println();
+        traceFile.close();
+}
+
+
+
+
+//=============================================================================
+
+bool isTracing(void)
+{
+        return tracing;
+}
+
+
+
+
+//=============================================================================
+// Records one command from the host.  This is called before the command is
+// processed, while its arguments are still in the Event.
+
+void traceCommand(Event *ep)
+{
+        if (!tracing)
+        {
+                return;
+        }
+        if (used >= TRACE_BUFFER)
+        {
+                traceFlush();
+        }
+
+        traceRecord_t *tp = &buffer[used++];
+        byte *bptr = ep->getData();
+
+        tp->time = micros();
+        tp->type = ep->getType();
+        tp->drive = TRACE_NO_DRIVE;
+        tp->sizeCode = 0;
+        tp->sector = 0;
+        tp->count = 0;
+
+        // The sector commands all start with the drive and size code.  The
+        // short ones then have a track, sector and sectors per track, the
+        // long ones a four byte sector number, and the multiple sector ones
+        // add a count where zero means 256.
+
+        switch (ep->getType())
+        {
+                case EVT_READ_SECTOR:
+                case EVT_WRITE_SECTOR:
+                        tp->drive = bptr[0];
+                        tp->sizeCode = bptr[1];
+                        tp->sector = (unsigned long)bptr[2] * bptr[4] + bptr[3];
+                        tp->count = 1;
+                        break;
+
+                case EVT_READ_SECTOR_LONG:
+                case EVT_WRITE_SECTOR_LONG:
+                        tp->drive = bptr[0];
+                        tp->sizeCode = bptr[1];
+                        tp->sector = getLong(bptr + 2);
+                        tp->count = 1;
+                        break;
+
+                case EVT_READ_MULTI_LONG:
+                case EVT_WRITE_MULTI_LONG:
+                        tp->drive = bptr[0];
+                        tp->sizeCode = bptr[1];
+                        tp->sector = getLong(bptr + 2);
+                        tp->count = bptr[6];
+                        break;
+
+                case EVT_MOUNT:
+                case EVT_UNMOUNT:
+                case EVT_OVERLAY:
+                        tp->drive = bptr[0];
+                        break;
+
+                default:
+                        break;
+        }
+}
+
+
+
+
+//=============================================================================
+// Writes the buffered records to the card.  The data isn't synced here; the
+// SD library writes a block out as each one fills, and traceStop closes the
+// file properly.
+
+void traceFlush(void)
+{
+        if (!tracing || used == 0)
+        {
+                return;
+        }
+
+        size_t length = used * sizeof(traceRecord_t);
+        if (traceFile.write((byte *)buffer, length) != length)
+        {
+                dropped += used;
+        }
+        used = 0;
+}
+
+
+
+
+//=============================================================================
+// Pulls a big-endian long out of a command's arguments.
+
+static unsigned long getLong(byte *bptr)
+{
+        unsigned long value = 0;
+
+        for (byte i = 0; i < 4; i++)
+        {
+                value = (value << 8) | *bptr++;
+        }
+        return value;
+}
+
+#endif  // TRACE_COMMANDS
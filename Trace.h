@@ -0,0 +1,65 @@
+//=============================================================================
+// FILE: Trace.h
+//
+// Command trace recorder.  When tracing is on, every sector command the host
+// sends is logged to TRACE_FILE on the SD card as a fixed size record: what
+// it was, which drive, the sector, how many sectors and when it arrived.
+// Records are collected in a small RAM buffer and written out when the link
+// is idle, so recording doesn't add much to the time of each command.
+//
+// The host/ directory has a replay tool that runs a trace against the same
+// Disks code on Linux, which turns a real workload into a benchmark.
+//
+// Send T on the debug serial port to start or stop a trace.
+
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include <stdint.h>
+#include "Event.h"
+
+// Define to include the recorder.  The buffer and the open File come out of
+// SRAM_RESERVED in Disk.h, like the latency histograms.
+
+#undef TRACE_COMMANDS
+
+#define TRACE_FILE  "TRACE.BIN"
+#define TRACE_MAGIC  0x31435254UL      // "TRC1" as stored on the card
+#define TRACE_BUFFER  8                 // records held in RAM
+
+// The buffer, the File and the counters.
+
+#ifdef TRACE_COMMANDS
+#define TRACE_RAM_USED  (TRACE_BUFFER * 12 + 40)
+#else
+#define TRACE_RAM_USED  0
+#endif
+
+// The file is a TRACE_MAGIC long followed by records.  Everything uses fixed
+// width types in the AVR's little-endian byte order so the replay tool can
+// read the file directly.
+//
+// Sector is the absolute sector number, already worked out from the track and
+// sector for the short commands.  Count is the number of sectors the command
+// moves; a WRITE_MULTI_DATA record is one sector of the run started by the
+// WRITE_MULTI_LONG before it and only has its type and time filled in.
+
+typedef struct
+{
+        uint32_t time;          // micros() when the command was processed
+        uint32_t sector;        // first sector
+        uint8_t type;           // EVENT_TYPE
+        uint8_t drive;
+        uint8_t sizeCode;
+        uint8_t count;          // sectors, 0 for non-sector commands
+} traceRecord_t;
+
+#define TRACE_NO_DRIVE  0xff    // drive for commands that don't name one
+
+bool traceStart(void);
+void traceStop(void);
+bool isTracing(void);
+void traceCommand(Event *ep);
+void traceFlush(void);
+
+#endif  // __TRACE_H__
@@ -0,0 +1,524 @@
+//=============================================================================
+// FILE: host/Arduino.cpp
+//
+// The PC versions of the Arduino core functions declared in host/Arduino.h.
+
+#include <stdio.h>
+#include <time.h>
+#include "Arduino.h"
+
+byte hostPins[HOST_PINS];
+void (*hostPinWritten)(int pin, int value);
+unsigned long hostPinAccesses;
+volatile byte PORTC, PINC, DDRC;
+volatile byte PORTD, PIND, DDRD;
+HostPinPort PORTL(49), PINL(49);
+volatile byte DDRL;
+
+HardwareSerial Serial;
+bool serialQuiet = false;
+
+static struct timespec startTime;
+static bool started = false;
+
+static struct
+{
+        void (*handler)(void);
+        int mode;
+        bool pending;
+} interruptTable[HOST_PINS];
+
+static bool interruptsOn = true;
+static bool inHandler = false;
+
+static void runInterrupts(void);
+
+
+
+
+//=============================================================================
+// Returns the time since the first call, the same way the Arduino counts
+// from reset.
+
+static unsigned long long elapsedMicros(void)
+{
+        struct timespec now;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (!started)
+        {
+                startTime = now;
+                started = true;
+        }
+        return (unsigned long long)(now.tv_sec - startTime.tv_sec) * 1000000ULL +
+               (now.tv_nsec - startTime.tv_nsec) / 1000;
+}
+
+
+
+
+//=============================================================================
+// These wrap at 32 bits like the real ones, so code that subtracts times
+// behaves the same.
+
+unsigned long millis(void)
+{
+        return (uint32_t)(elapsedMicros() / 1000);
+}
+
+
+
+
+//=============================================================================
+
+unsigned long micros(void)
+{
+        return (uint32_t)elapsedMicros();
+}
+
+
+
+
+//=============================================================================
+
+void delay(unsigned long ms)
+{
+        struct timespec ts;
+
+        ts.tv_sec = ms / 1000;
+        ts.tv_nsec = (ms % 1000) * 1000000L;
+        nanosleep(&ts, NULL);
+}
+
+
+
+
+//=============================================================================
+
+void delayMicroseconds(unsigned int us)
+{
+        struct timespec ts;
+
+        ts.tv_sec = 0;
+        ts.tv_nsec = us * 1000L;
+        nanosleep(&ts, NULL);
+}
+
+
+
+
+//=============================================================================
+
+void pinMode(int pin, int mode)
+{
+        if (mode == INPUT_PULLUP && pin >= 0 && pin < HOST_PINS)
+        {
+                hostPins[pin] = HIGH;
+        }
+}
+
+
+
+
+//=============================================================================
+
+void digitalWrite(int pin, int value)
+{
+        hostPinAccesses++;
+        if (pin >= 0 && pin < HOST_PINS)
+        {
+                hostPins[pin] = value ? HIGH : LOW;
+        }
+        if (hostPinWritten)
+        {
+                hostPinWritten(pin, value);
+        }
+}
+
+
+
+
+//=============================================================================
+
+int digitalRead(int pin)
+{
+        hostPinAccesses++;
+        return (pin >= 0 && pin < HOST_PINS) ? hostPins[pin] : LOW;
+}
+
+
+
+
+//=============================================================================
+// Returns the pins in bits as they would be read from the port.
+
+byte HostPinPort::read(byte bits) const
+{
+        byte value = 0;
+
+        hostPinAccesses++;
+
+        for (int bit = 0; bits; bit++, bits >>= 1)
+        {
+                if ((bits & 1) && hostPins[bit0Pin - bit])
+                {
+                        value |= 1 << bit;
+                }
+        }
+        return value;
+}
+
+
+
+
+//=============================================================================
+// Only the bits that change are written, so hostPinWritten sees an edge just
+// where the real pin would have one.
+
+HostPinPort &HostPinPort::operator=(byte value)
+{
+        byte changed = read(0xff) ^ value;
+
+        for (int bit = 0; changed; bit++, changed >>= 1)
+        {
+                if (changed & 1)
+                {
+                        digitalWrite(bit0Pin - bit, (value >> bit) & 1);
+                }
+        }
+        return *this;
+}
+
+
+
+
+//=============================================================================
+
+HostPinPort &HostPinPort::operator|=(byte bits)
+{
+        byte changed = bits & ~read(bits);
+
+        for (int bit = 0; changed; bit++, changed >>= 1)
+        {
+                if (changed & 1)
+                {
+                        digitalWrite(bit0Pin - bit, HIGH);
+                }
+        }
+        return *this;
+}
+
+
+
+
+//=============================================================================
+
+HostPinPort &HostPinPort::operator&=(byte bits)
+{
+        byte changed = read(~bits);
+
+        for (int bit = 0; changed; bit++, changed >>= 1)
+        {
+                if (changed & 1)
+                {
+                        digitalWrite(bit0Pin - bit, LOW);
+                }
+        }
+        return *this;
+}
+
+
+
+
+//=============================================================================
+
+void attachInterrupt(int interrupt, void (*handler)(void), int mode)
+{
+        if (interrupt >= 0 && interrupt < HOST_PINS)
+        {
+                interruptTable[interrupt].handler = handler;
+                interruptTable[interrupt].mode = mode;
+                interruptTable[interrupt].pending = false;
+        }
+}
+
+
+
+
+//=============================================================================
+
+void detachInterrupt(int interrupt)
+{
+        if (interrupt >= 0 && interrupt < HOST_PINS)
+        {
+                interruptTable[interrupt].handler = NULL;
+        }
+}
+
+
+
+
+//=============================================================================
+
+void noInterrupts(void)
+{
+        interruptsOn = false;
+}
+
+
+
+
+//=============================================================================
+
+void interrupts(void)
+{
+        interruptsOn = true;
+        runInterrupts();
+}
+
+
+
+
+//=============================================================================
+// Sets an input pin from outside the sketch.  If it changed and an interrupt
+// is attached for that edge, the interrupt is flagged and run if allowed.
+
+void hostSetInput(int pin, int value)
+{
+        if (pin < 0 || pin >= HOST_PINS)
+        {
+                return;
+        }
+
+        byte old = hostPins[pin];
+        hostPins[pin] = value ? HIGH : LOW;
+        if (old == hostPins[pin] || interruptTable[pin].handler == NULL)
+        {
+                return;
+        }
+
+        int mode = interruptTable[pin].mode;
+        if (mode == CHANGE || (mode == RISING) == (value != LOW))
+        {
+                interruptTable[pin].pending = true;
+                runInterrupts();
+        }
+}
+
+
+
+
+//=============================================================================
+// Runs flagged handlers until none are left.  A handler that causes another
+// edge, through the virtual host, just flags it, so this loops rather than
+// nesting.
+
+static void runInterrupts(void)
+{
+        bool ran = true;
+
+        if (!interruptsOn || inHandler)
+        {
+                return;
+        }
+
+        inHandler = true;
+        while (ran)
+        {
+                ran = false;
+                for (int i = 0; i < HOST_PINS; i++)
+                {
+                        if (interruptTable[i].pending && interruptTable[i].handler)
+                        {
+                                interruptTable[i].pending = false;
+                                interruptTable[i].handler();
+                                ran = true;
+                        }
+                }
+        }
+        inHandler = false;
+}
+
+
+
+
+//=============================================================================
+// Print formats everything into characters and hands them to write(), the
+// same as the Arduino's version.
+
+size_t Print::write(const byte *buf, size_t size)
+{
+        size_t count = 0;
+
+        while (size--)
+        {
+                count += write(*buf++);
+        }
+        return count;
+}
+
+
+
+
+//=============================================================================
+
+size_t Print::print(const char *str)
+{
+        return write((const byte *)str, strlen(str));
+}
+
+
+
+
+//=============================================================================
+
+size_t Print::print(char c)
+{
+        return write((byte)c);
+}
+
+
+
+
+//=============================================================================
+
+size_t Print::print(unsigned char value, int base)
+{
+        return printNumber(value, base);
+}
+
+
+
+
+//=============================================================================
+
+size_t Print::print(int value, int base)
+{
+        return print((long)value, base);
+}
+
+
+
+
+//=============================================================================
+
+size_t Print::print(unsigned value, int base)
+{
+        return printNumber(value, base);
+}
+
+
+
+
+//=============================================================================
+// Only decimal numbers get a minus sign; the Arduino prints negative hex
+// values as unsigned.
+
+size_t Print::print(long value, int base)
+{
+        if (base == DEC && value < 0)
+        {
+                return print('-') + printNumber(-value, base);
+        }
+        return printNumber((uint32_t)value, base);
+}
+
+
+
+
+//=============================================================================
+
+size_t Print::print(unsigned long value, int base)
+{
+        return printNumber(value, base);
+}
+
+
+
+
+//=============================================================================
+
+size_t Print::print(double value, int digits)
+{
+        char buf[40];
+
+        snprintf(buf, sizeof(buf), "%.*f", digits, value);
+        return print(buf);
+}
+
+
+
+
+//=============================================================================
+
+size_t Print::println(void)
+{
+        return write((const byte *)"\r\n", 2);
+}
+
+
+
+
+//=============================================================================
+
+size_t Print::printNumber(unsigned long value, int base)
+{
+        char buf[40];
+        char *cptr = &buf[sizeof(buf) - 1];
+
+        *cptr = '\0';
+        do
+        {
+                byte digit = value % base;
+                *--cptr = (digit < 10) ? '0' + digit : 'A' + digit - 10;
+                value /= base;
+        } while (value);
+        return print(cptr);
+}
+
+
+
+
+//=============================================================================
+// The debug port goes to stdout.  Carriage returns are dropped so the output
+// looks right in a terminal or a log file.
+
+size_t HardwareSerial::write(byte value)
+{
+        if (!serialQuiet && value != '\r')
+        {
+                putchar(value);
+        }
+        return 1;
+}
+
+
+
+
+//=============================================================================
+
+void HardwareSerial::flush(void)
+{
+        fflush(stdout);
+}
+
+
+
+
+//=============================================================================
+// Nothing is ever typed on the debug port.
+
+int HardwareSerial::available(void)
+{
+        return 0;
+}
+
+
+
+
+//=============================================================================
+
+int HardwareSerial::read(void)
+{
+        return -1;
+}
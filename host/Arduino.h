@@ -0,0 +1,150 @@
+//=============================================================================
+// FILE: host/Arduino.h
+//
+// Just enough of the Arduino core to build the drive code on a PC.  Time
+// comes from the system clock, pins are a table of bytes, the I/O port
+// registers used by link.cpp are plain variables, and Serial writes to
+// stdout (or nowhere, if serialQuiet is set).
+//
+// None of this is used by the sketch on the Arduino; see the Makefile in this
+// directory.
+
+#ifndef __HOST_ARDUINO_H__
+#define __HOST_ARDUINO_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef uint8_t byte;
+typedef uint16_t word;
+typedef bool boolean;
+
+#define HIGH  1
+#define LOW  0
+#define INPUT  0
+#define OUTPUT  1
+#define INPUT_PULLUP  2
+
+#define DEC  10
+#define HEX  16
+
+#define F(s)  (s)
+
+// Digital pins.  Writes to an output pin and reads of an input pin both go
+// to the same table, so a test can set the value an input pin will read.
+// An input with a pull-up reads HIGH until something sets it.  If
+// hostPinWritten is set it's called after every digitalWrite, which is how
+// the virtual host in vhost.cpp follows the link handshake.
+
+#define HOST_PINS  70
+
+extern byte hostPins[HOST_PINS];
+extern void (*hostPinWritten)(int pin, int value);
+
+// Every digitalRead(), digitalWrite() and port L access is counted, which is
+// a better guide to the cost of the handshake on the Mega than the PC's time.
+
+extern unsigned long hostPinAccesses;
+
+void pinMode(int pin, int mode);
+void digitalWrite(int pin, int value);
+int digitalRead(int pin);
+
+// The Mega port registers that link.cpp uses for the data bus.
+
+extern volatile byte PORTC, PINC, DDRC;
+extern volatile byte PORTD, PIND, DDRD;
+
+// Port L carries the handshake lines.  Its bits are pins 49 (bit 0) down to
+// 42 (bit 7), so writing PORTL or reading PINL goes through the pin table and
+// the handshake looks the same whether link.cpp uses the port or
+// digitalWrite().  Only the pins in a mask are looked at, so testing one bit
+// costs about what one digitalRead() does.
+
+class HostPinPort
+{
+        public:
+                HostPinPort(int bit0Pin) : bit0Pin(bit0Pin) {}
+                operator byte(void) const { return read(0xff); }
+                HostPinPort &operator=(byte value);
+                HostPinPort &operator|=(byte bits);
+                HostPinPort &operator&=(byte bits);
+                byte operator&(byte bits) const { return read(bits); }
+
+        private:
+                byte read(byte bits) const;
+                int bit0Pin;
+};
+
+extern HostPinPort PORTL, PINL;
+extern volatile byte DDRL;
+
+// Interrupts.  The interrupt number is just the pin number.  Something
+// outside the sketch, like vhost.cpp, changes an input with hostSetInput(),
+// which runs the pin's handler if the edge matches.  As on the AVR, handlers
+// don't interrupt each other or run while interrupts are off; an edge that
+// comes then is remembered and handled as soon as they're allowed.
+
+#define CHANGE  1
+#define FALLING  2
+#define RISING  3
+
+#define digitalPinToInterrupt(pin)  (pin)
+
+void attachInterrupt(int interrupt, void (*handler)(void), int mode);
+void detachInterrupt(int interrupt);
+void noInterrupts(void);
+void interrupts(void);
+void hostSetInput(int pin, int value);
+
+unsigned long millis(void);
+unsigned long micros(void);
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+
+// Strings kept in flash on an AVR.  A PC only has the one kind of memory.
+
+#define PROGMEM
+class __FlashStringHelper;
+
+class Print
+{
+        public:
+                virtual ~Print(void) {}
+                virtual size_t write(byte value) = 0;
+                virtual size_t write(const byte *buf, size_t size);
+                size_t print(const char *str);
+                size_t print(const __FlashStringHelper *str) { return print((const char *)str); }
+                size_t print(char c);
+                size_t print(unsigned char value, int base = DEC);
+                size_t print(int value, int base = DEC);
+                size_t print(unsigned value, int base = DEC);
+                size_t print(long value, int base = DEC);
+                size_t print(unsigned long value, int base = DEC);
+                size_t print(double value, int digits = 2);
+                size_t println(void);
+                template <typename T> size_t println(T value) { size_t n = print(value); return n + println(); }
+                template <typename T> size_t println(T value, int base) { size_t n = print(value, base); return n + println(); }
+
+        private:
+                size_t printNumber(unsigned long value, int base);
+};
+
+class HardwareSerial : public Print
+{
+        public:
+                void begin(unsigned long baud) {}
+                int available(void);
+                int read(void);
+                void flush(void);
+                size_t write(byte value);
+                using Print::write;
+                operator bool(void) { return true; }
+};
+
+extern HardwareSerial Serial;
+extern bool serialQuiet;
+
+#endif  // __HOST_ARDUINO_H__
@@ -0,0 +1,397 @@
+//=============================================================================
+// FILE: host/SD.cpp
+//
+// The PC version of the SD library declared in host/SD.h.  Files are read and
+// written with pread() and pwrite() at a position kept here, so every call
+// the drive code makes reaches the operating system, much like every call
+// reaches the card on the Arduino.
+
+#include <dirent.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <string>
+#include "SD.h"
+
+SDClass SD;
+
+struct hostFile_t
+{
+        int fd;                 // open file, or -1
+        DIR *dir;               // open directory, or NULL
+        bool append;            // FILE_WRITE: writes go to the end
+        uint32_t pos;
+        char name[256];
+
+        hostFile_t(void) : fd(-1), dir(NULL), append(false), pos(0) { name[0] = '\0'; }
+        ~hostFile_t(void) { closeAll(); }
+
+        void closeAll(void)
+        {
+                if (fd >= 0)
+                {
+                        ::close(fd);
+                        fd = -1;
+                }
+                if (dir)
+                {
+                        closedir(dir);
+                        dir = NULL;
+                }
+        }
+};
+
+static std::string findName(const char *filename);
+
+
+
+
+//=============================================================================
+// Opens a file or, for "/", the directory.  Returns a File that tests false
+// if it can't.
+
+File SDClass::open(const char *filename, int mode)
+{
+        File file;
+        std::shared_ptr<hostFile_t> hp = std::make_shared<hostFile_t>();
+
+        while (*filename == '/')
+        {
+                filename++;
+        }
+        if (*filename == '\0')
+        {
+                hp->dir = opendir(".");
+                if (hp->dir)
+                {
+                        strcpy(hp->name, "/");
+                        file.state = hp;
+                }
+                return file;
+        }
+
+        std::string name = findName(filename);
+        struct stat st;
+
+        if (stat(name.c_str(), &st) == 0 && S_ISDIR(st.st_mode))
+        {
+                hp->dir = opendir(name.c_str());
+        }
+        else
+        {
+                int flags = ((mode & O_ACCMODE) == O_RDONLY) ? O_RDONLY : O_RDWR;
+                hp->fd = ::open(name.c_str(), flags | (mode & O_CREAT), 0644);
+                hp->append = (mode & O_APPEND) != 0;
+        }
+        if (hp->fd < 0 && hp->dir == NULL)
+        {
+                return file;
+        }
+
+        snprintf(hp->name, sizeof(hp->name), "%s", name.c_str());
+        file.state = hp;
+        return file;
+}
+
+
+
+
+//=============================================================================
+
+bool SDClass::exists(const char *filename)
+{
+        struct stat st;
+
+        return stat(findName(filename).c_str(), &st) == 0;
+}
+
+
+
+
+//=============================================================================
+
+bool SDClass::remove(const char *filename)
+{
+        return unlink(findName(filename).c_str()) == 0;
+}
+
+
+
+
+//=============================================================================
+// Everything after this works in the directory, so the names the drive code
+// uses don't need changing.
+
+bool SDClass::setCard(const char *directory)
+{
+        return chdir(directory) == 0;
+}
+
+
+
+
+//=============================================================================
+
+size_t File::write(byte value)
+{
+        return write(&value, 1);
+}
+
+
+
+
+//=============================================================================
+
+size_t File::write(const byte *buf, size_t size)
+{
+        if (!state || state->fd < 0)
+        {
+                return 0;
+        }
+        if (state->append)
+        {
+                state->pos = this->size();
+        }
+
+        ssize_t count = pwrite(state->fd, buf, size, state->pos);
+        if (count < 0)
+        {
+                return 0;
+        }
+        state->pos += count;
+        return count;
+}
+
+
+
+
+//=============================================================================
+
+int File::read(void)
+{
+        byte value;
+
+        return (read(&value, 1) == 1) ? value : -1;
+}
+
+
+
+
+//=============================================================================
+
+int File::read(void *buf, uint16_t size)
+{
+        if (!state || state->fd < 0)
+        {
+                return -1;
+        }
+
+        ssize_t count = pread(state->fd, buf, size, state->pos);
+        if (count < 0)
+        {
+                return -1;
+        }
+        state->pos += count;
+        return count;
+}
+
+
+
+
+//=============================================================================
+
+int File::peek(void)
+{
+        int value = read();
+
+        if (value >= 0)
+        {
+                state->pos--;
+        }
+        return value;
+}
+
+
+
+
+//=============================================================================
+// For a directory this is just non-zero, which is what sendDirectory checks.
+
+int File::available(void)
+{
+        if (!state)
+        {
+                return 0;
+        }
+        if (state->dir)
+        {
+                return 1;
+        }
+        uint32_t length = size();
+        return (state->pos < length) ? length - state->pos : 0;
+}
+
+
+
+
+//=============================================================================
+// Every write already went to the operating system.
+
+void File::flush(void)
+{
+}
+
+
+
+
+//=============================================================================
+
+bool File::seek(uint32_t pos)
+{
+        if (!state || state->fd < 0)
+        {
+                return false;
+        }
+        state->pos = pos;
+        return true;
+}
+
+
+
+
+//=============================================================================
+
+uint32_t File::position(void)
+{
+        return state ? state->pos : 0;
+}
+
+
+
+
+//=============================================================================
+
+uint32_t File::size(void)
+{
+        struct stat st;
+
+        if (!state || state->fd < 0 || fstat(state->fd, &st) != 0)
+        {
+                return 0;
+        }
+        return st.st_size;
+}
+
+
+
+
+//=============================================================================
+// Closes the file for every copy of this File, as on the Arduino.
+
+void File::close(void)
+{
+        if (state)
+        {
+                state->closeAll();
+                state.reset();
+        }
+}
+
+
+
+
+//=============================================================================
+
+File::operator bool(void)
+{
+        return state && (state->fd >= 0 || state->dir != NULL);
+}
+
+
+
+
+//=============================================================================
+
+char *File::name(void)
+{
+        return state ? state->name : (char *)"";
+}
+
+
+
+
+//=============================================================================
+
+bool File::isDirectory(void)
+{
+        return state && state->dir != NULL;
+}
+
+
+
+
+//=============================================================================
+// Opens the next entry in a directory, skipping . and .. and anything that
+// isn't a plain file or directory.
+
+File File::openNextFile(int mode)
+{
+        struct dirent *dp;
+
+        while (state && state->dir && (dp = readdir(state->dir)) != NULL)
+        {
+                if (dp->d_name[0] == '.' || (dp->d_type != DT_REG && dp->d_type != DT_DIR))
+                {
+                        continue;
+                }
+                return SD.open(dp->d_name, mode);
+        }
+        return File();
+}
+
+
+
+
+//=============================================================================
+
+void File::rewindDirectory(void)
+{
+        if (state && state->dir)
+        {
+                rewinddir(state->dir);
+        }
+}
+
+
+
+
+//=============================================================================
+// FAT doesn't care about case, so look for an existing file with the same
+// name in any case.  A name that isn't there is returned as it was given,
+// which is what a new file will be called.
+
+static std::string findName(const char *filename)
+{
+        while (*filename == '/')
+        {
+                filename++;
+        }
+
+        std::string name = filename;
+        DIR *dir = opendir(".");
+        struct dirent *dp;
+
+        if (dir)
+        {
+                while ((dp = readdir(dir)) != NULL)
+                {
+                        if (strcasecmp(dp->d_name, filename) == 0)
+                        {
+                                name = dp->d_name;
+                                break;
+                        }
+                }
+                closedir(dir);
+        }
+        return name;
+}
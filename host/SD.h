@@ -0,0 +1,70 @@
+//=============================================================================
+// FILE: host/SD.h
+//
+// A PC stand-in for the Arduino SD library.  The "card" is the current
+// directory: file names are looked up without regard to case, like FAT, and
+// each File is an ordinary stdio file.  Copies of a File share the open file
+// the way they do on the Arduino, where File is a small handle.
+
+#ifndef __HOST_SD_H__
+#define __HOST_SD_H__
+
+#include <memory>
+#include "Arduino.h"
+
+// The open modes are the POSIX ones, which the SD library's O_RDWR, O_CREAT
+// and O_APPEND match by name.
+
+#include <fcntl.h>
+
+#define O_READ  O_RDONLY
+#define O_WRITE  O_WRONLY
+
+#define FILE_READ  O_READ
+#define FILE_WRITE  (O_RDWR | O_CREAT | O_APPEND)
+
+struct hostFile_t;
+
+class File : public Print
+{
+        public:
+                File(void) {}
+                size_t write(byte value);
+                size_t write(const byte *buf, size_t size);
+                size_t write(const char *str) { return write((const byte *)str, strlen(str)); }
+                int read(void);
+                int read(void *buf, uint16_t size);
+                int peek(void);
+                int available(void);
+                void flush(void);
+                bool seek(uint32_t pos);
+                uint32_t position(void);
+                uint32_t size(void);
+                void close(void);
+                operator bool(void);
+                char *name(void);
+                bool isDirectory(void);
+                File openNextFile(int mode = O_READ);
+                void rewindDirectory(void);
+
+        private:
+                std::shared_ptr<hostFile_t> state;
+                friend class SDClass;
+};
+
+class SDClass
+{
+        public:
+                bool begin(byte csPin) { return true; }
+                File open(const char *filename, int mode = FILE_READ);
+                bool exists(const char *filename);
+                bool remove(const char *filename);
+
+                // Only on a PC: makes a directory the card.
+
+                bool setCard(const char *directory);
+};
+
+extern SDClass SD;
+
+#endif  // __HOST_SD_H__
@@ -0,0 +1,10 @@
+//=============================================================================
+// FILE: host/SPI.h
+//
+// The drive code includes SPI.h for the SD library; on a PC there is nothing
+// in it.
+
+#ifndef __HOST_SPI_H__
+#define __HOST_SPI_H__
+
+#endif  // __HOST_SPI_H__
@@ -0,0 +1,101 @@
+//=============================================================================
+// FILE: host/Wire.cpp
+//
+// The pretend DS3231 declared in host/Wire.h.
+
+#include <time.h>
+#include "Wire.h"
+
+TwoWire Wire;
+
+static byte toBcd(int value);
+
+
+
+
+//=============================================================================
+
+void TwoWire::beginTransmission(int address)
+{
+        addressed = true;
+}
+
+
+
+
+//=============================================================================
+// The first byte written sets the register pointer, the rest would be the
+// new time.
+
+size_t TwoWire::write(byte value)
+{
+        if (addressed)
+        {
+                pointer = value;
+                addressed = false;
+        }
+        return 1;
+}
+
+
+
+
+//=============================================================================
+
+byte TwoWire::endTransmission(void)
+{
+        return 0;
+}
+
+
+
+
+//=============================================================================
+// Loads the time registers from the PC's clock, the same layout as the
+// DS3231: seconds, minutes, hours, day of week (1 = Sunday), day of month,
+// month and year.
+
+byte TwoWire::requestFrom(int address, int count)
+{
+        time_t now = time(NULL);
+        struct tm *tp = localtime(&now);
+
+        registers[0] = toBcd(tp->tm_sec);
+        registers[1] = toBcd(tp->tm_min);
+        registers[2] = toBcd(tp->tm_hour);
+        registers[3] = toBcd(tp->tm_wday + 1);
+        registers[4] = toBcd(tp->tm_mday);
+        registers[5] = toBcd(tp->tm_mon + 1);
+        registers[6] = toBcd(tp->tm_year % 100);
+        return count;
+}
+
+
+
+
+//=============================================================================
+
+int TwoWire::available(void)
+{
+        return (pointer < sizeof(registers)) ? sizeof(registers) - pointer : 0;
+}
+
+
+
+
+//=============================================================================
+
+int TwoWire::read(void)
+{
+        return (pointer < sizeof(registers)) ? registers[pointer++] : 0;
+}
+
+
+
+
+//=============================================================================
+
+static byte toBcd(int value)
+{
+        return (value / 10 * 16) + (value % 10);
+}
@@ -0,0 +1,31 @@
+//=============================================================================
+// FILE: host/Wire.h
+//
+// A PC stand-in for the Arduino Wire library with a DS3231 on the bus.  The
+// clock reads the PC's local time; setting it is accepted and ignored.
+
+#ifndef __HOST_WIRE_H__
+#define __HOST_WIRE_H__
+
+#include "Arduino.h"
+
+class TwoWire
+{
+        public:
+                void begin(void) {}
+                void beginTransmission(int address);
+                size_t write(byte value);
+                byte endTransmission(void);
+                byte requestFrom(int address, int count);
+                int available(void);
+                int read(void);
+
+        private:
+                byte registers[7];      // DS3231 time registers, in BCD
+                byte pointer;           // next register to read
+                bool addressed;         // next write sets the pointer
+};
+
+extern TwoWire Wire;
+
+#endif  // __HOST_WIRE_H__
@@ -0,0 +1,318 @@
+//=============================================================================
+// FILE: host/replay.cpp
+//
+// Replays a command trace recorded by Trace.cpp against the real Disks and
+// Disk code, on a PC, and reports how fast it went and how well the caches
+// did.  This makes a real workload, like a FLEX assembly or a big COPY, into
+// a benchmark that can be run over and over while tuning the drive code.
+//
+//    replay [-q] [-n] [-l loops] directory trace
+//
+// The directory takes the place of the SD card: it needs the SD.CFG and the
+// image files that were mounted when the trace was made.  Writes in the trace
+// are replayed with made up data, so run it on a copy of the images.
+//
+//    -q        don't show the drive code's debug output
+//    -n        no read-ahead between commands; normally the drives get as
+//              much idle time as they want, as with a slow host
+//    -l loops  run the trace this many times
+
+#include <stdio.h>
+#include <getopt.h>
+#include <time.h>
+#include <SD.h>
+#include "link.h"
+#include "Disks.h"
+#include "Trace.h"
+
+Link *link;     // SdFuncs.cpp wants one; it isn't used here
+
+static_assert(sizeof(traceRecord_t) == 12, "trace records must match the Arduino's");
+
+// What the replay did, apart from what Disks counts itself.
+
+static unsigned long commands;          // sector commands replayed
+static unsigned long sectorsRead;
+static unsigned long sectorsWritten;
+static unsigned long failures;          // reads or writes that failed
+static unsigned long skipped;           // other commands, not replayed
+
+static void replay(Disks *disks, traceRecord_t *records, size_t count, bool readAhead);
+static void report(Disks *disks, double seconds);
+static double now(void);
+
+
+
+
+//=============================================================================
+
+int main(int argc, char **argv)
+{
+        bool readAhead = true;
+        int loops = 1;
+        int opt;
+
+        while ((opt = getopt(argc, argv, "qnl:")) != -1)
+        {
+                switch (opt)
+                {
+                        case 'q':
+                                serialQuiet = true;
+                                break;
+
+                        case 'n':
+                                readAhead = false;
+                                break;
+
+                        case 'l':
+                                loops = atoi(optarg);
+                                break;
+
+                        default:
+                                fprintf(stderr, "usage: replay [-q] [-n] [-l loops] directory trace\n");
+                                return 1;
+                }
+        }
+        if (argc - optind != 2)
+        {
+                fprintf(stderr, "usage: replay [-q] [-n] [-l loops] directory trace\n");
+                return 1;
+        }
+
+        // Read the whole trace before starting so file reads don't get
+        // counted in the time.
+
+        FILE *fp = fopen(argv[optind + 1], "rb");
+        uint32_t magic;
+
+        if (fp == NULL || fread(&magic, sizeof(magic), 1, fp) != 1 || magic != TRACE_MAGIC)
+        {
+                fprintf(stderr, "%s isn't a trace file\n", argv[optind + 1]);
+                return 1;
+        }
+
+        size_t size = 0;
+        size_t count = 0;
+        traceRecord_t *records = NULL;
+
+        for (;;)
+        {
+                if (count == size)
+                {
+                        size = size ? size * 2 : 1024;
+                        records = (traceRecord_t *)realloc(records, size * sizeof(traceRecord_t));
+                }
+                if (fread(&records[count], sizeof(traceRecord_t), 1, fp) != 1)
+                {
+                        break;
+                }
+                count++;
+        }
+        fclose(fp);
+
+        if (!SD.setCard(argv[optind]))
+        {
+                perror(argv[optind]);
+                return 1;
+        }
+
+        Disks *disks = new Disks();
+        disks->mountDefaults();
+
+        double start = now();
+        for (int i = 0; i < loops; i++)
+        {
+                replay(disks, records, count, readAhead);
+        }
+        disks->commit();
+        double seconds = now() - start;
+
+        report(disks, seconds);
+        disks->closeAll();
+        free(records);
+        return 0;
+}
+
+
+
+
+//=============================================================================
+// Runs the trace once.  Each sector command goes through Disks just as
+// processEvent would send it, and the drives get their idle and poll calls
+// the way loop() gives them.
+
+static void replay(Disks *disks, traceRecord_t *records, size_t count, bool readAhead)
+{
+        byte buffer[MAX_SECTOR_SIZE];
+        byte runDrive = 0;
+        unsigned long runSector = 0;
+        double nextPoll = now() + 0.1;
+
+        for (size_t i = 0; i < count; i++)
+        {
+                traceRecord_t *tp = &records[i];
+                unsigned sectors = (tp->count == 0) ? 256 : tp->count;
+                bool ok = true;
+
+                switch (tp->type)
+                {
+                        case EVT_READ_SECTOR:
+                        case EVT_READ_SECTOR_LONG:
+                        case EVT_READ_MULTI_LONG:
+                                commands++;
+                                if (!disks->checkRequest(tp->drive, tp->sizeCode))
+                                {
+                                        failures++;
+                                        break;
+                                }
+                                for (unsigned s = 0; s < sectors && ok; s++)
+                                {
+                                        ok = disks->read(tp->drive, (tp->sector + s) * disks->getSectorSize(tp->drive), buffer);
+                                        sectorsRead++;
+                                }
+                                if (!ok)
+                                {
+                                        failures++;
+                                }
+                                break;
+
+                        case EVT_WRITE_SECTOR:
+                        case EVT_WRITE_SECTOR_LONG:
+                                commands++;
+                                if (!disks->checkRequest(tp->drive, tp->sizeCode))
+                                {
+                                        failures++;
+                                        break;
+                                }
+                                memset(buffer, (byte)tp->sector, sizeof(buffer));
+                                if (!disks->write(tp->drive, tp->sector * disks->getSectorSize(tp->drive), buffer))
+                                {
+                                        failures++;
+                                }
+                                sectorsWritten++;
+                                break;
+
+                        case EVT_WRITE_MULTI_LONG:
+                                // The sectors come in the WRITE_MULTI_DATA
+                                // records that follow.
+
+                                commands++;
+                                runDrive = tp->drive;
+                                runSector = tp->sector;
+                                if (!disks->checkRequest(tp->drive, tp->sizeCode))
+                                {
+                                        failures++;
+                                }
+                                break;
+
+                        case EVT_WRITE_MULTI_DATA:
+                                memset(buffer, (byte)runSector, sizeof(buffer));
+                                if (disks->isDriveValid(runDrive) &&
+                                    !disks->write(runDrive, runSector * disks->getSectorSize(runDrive), buffer))
+                                {
+                                        failures++;
+                                }
+                                runSector++;
+                                sectorsWritten++;
+                                break;
+
+                        case EVT_DONE:
+                                disks->commit();
+                                break;
+
+                        default:
+                                skipped++;
+                                break;
+                }
+
+                while (readAhead && disks->idle())
+                {
+                }
+                if (now() >= nextPoll)
+                {
+                        disks->poll();
+                        nextPoll = now() + 0.1;
+                }
+        }
+}
+
+
+
+
+//=============================================================================
+
+static void report(Disks *disks, double seconds)
+{
+        printf("\n%lu commands in %.3f seconds, %.0f commands/s\n", commands, seconds,
+               seconds > 0 ? commands / seconds : 0.0);
+        printf("%lu sectors read, %lu written, %lu failed, %lu other commands skipped\n",
+               sectorsRead, sectorsWritten, failures, skipped);
+        printf("%lu bytes to host, %lu from host, %.1f KB/s\n",
+               disks->getBytesToHost(), disks->getBytesFromHost(),
+               seconds > 0 ? (disks->getBytesToHost() + disks->getBytesFromHost()) / seconds / 1024 : 0.0);
+
+        printf("\ndrive     reads    writes   hits  misses  hit%%  read-ahead hits\n");
+        for (byte d = 0; d < MAX_DISKS; d++)
+        {
+                if (!disks->isMounted(d))
+                {
+                        continue;
+                }
+
+                unsigned long hits = disks->getCacheHits(d);
+                unsigned long misses = disks->getCacheMisses(d);
+
+                printf("%3u  %9lu %9lu %6lu %7lu %5.1f  %lu\n", d,
+                       disks->getReads(d), disks->getWrites(d), hits, misses,
+                       (hits + misses) ? 100.0 * hits / (hits + misses) : 0.0,
+                       disks->getReadAheadHits(d));
+        }
+}
+
+
+
+
+//=============================================================================
+
+static double now(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+
+
+//=============================================================================
+// These are in the sketch on the Arduino.
+
+unsigned getSectorSize(byte code)
+{
+        return (code >= 1 && code <= 4) ? 64U << code : 256;
+}
+
+
+
+
+//=============================================================================
+// Pins read whatever is in hostPins, which is LOW, so the card is always
+// there.
+
+bool debounceInputPin(int pin)
+{
+        return digitalRead(pin);
+}
+
+
+
+
+//=============================================================================
+// A RAM-resident drive gets what a Mega would have left with the default
+// settings, more or less.
+
+int freeMemory(void)
+{
+        return 4096;
+}
@@ -0,0 +1,873 @@
+//=============================================================================
+// FILE: host/vhost.cpp
+//
+// A virtual host for the PC build of the whole sketch.  It runs setup() and
+// loop() from SD-drive.ino and plays the host's side of the parallel link
+// handshake through the pretend pins, so every command goes through the real
+// Link state machine, processEvent and the drive code, just as it would from
+// a 6800 or 6502.  That makes the whole path something perf can look at.
+//
+//    vhost [-q] directory [script]
+//
+// The directory takes the place of the SD card, and SD.CFG in it is mounted
+// as usual.  The script, or standard input, has one command per line:
+//
+//    size CODE               sector size code for the commands after it
+//                            (1 = 128, 2 = 256, the default, 3 = 512, 4 = 1024)
+//    mount D NAME [FLAGS]    PROTO_MOUNT, FLAGS as in the protocol
+//    unmount D
+//    read D SECTOR [COUNT]   READ_SECTOR_LONG, or READ_MULTI_LONG for a count
+//    write D SECTOR [COUNT]  the same for writes, with a known pattern
+//    check D SECTOR [COUNT]  a read that must return what write wrote
+//    done                    PROTO_DONE
+//    ping
+//    stats                   PROTO_GET_STATS
+//    dir                     PROTO_GET_DIR, which has to end with PROTO_DIR_END
+//    mounted                 PROTO_GET_MOUNTED_LIST, the same
+//    version                 PROTO_VERSION
+//    handshake MODE          PROTO_SET_HANDSHAKE, 0 = four phase, 1 = toggle;
+//                            the virtual host switches too if it's ACKed
+//    quiet MS                runs the sketch for MS milliseconds without
+//                            sending anything; after HANDSHAKE_TIMEOUT the
+//                            virtual host goes back to four phase, as a
+//                            real one has to
+//    merge D                 PROTO_OVERLAY, merge the drive's overlay
+//    discard D               PROTO_OVERLAY, throw the drive's overlay away
+//    overlay D A             PROTO_OVERLAY with any action byte A
+//    convert NAME [C [F]]    PROTO_CONVERT, raw to sparse or sparse to raw;
+//                            C is the sector size code and F the byte a
+//                            sparse image leaves out
+//    format NAME T S [F [X]] PROTO_FORMAT, T tracks of S sectors filled with
+//                            F; X is the flags, 1 for a FLEX layout
+//    card NAME SECTOR [COUNT] reads the image file itself, not through the
+//                            sketch, and checks it holds what write wrote
+//    flexcheck D T S [F]     reads back the SIR, the directory chain and the
+//                            free chain of a freshly formatted FLEX disk of
+//                            T tracks of S sectors, filled with F
+//    not COMMAND             COMMAND has to fail, such as a check of a
+//                            sector that was never written
+//    repeat N STEP COMMAND   runs COMMAND N times, adding STEP to its sector
+//                            each time; only the totals are shown
+//
+// Blank lines and lines starting with # are ignored.  The exit status is 1 if
+// any command failed, so scripts can be used as tests.
+//
+//    -q        don't show the sketch's debug output
+
+#include <stdio.h>
+#include <getopt.h>
+#include <time.h>
+#include <vector>
+#include <SD.h>
+#include "link.h"
+#include "Disks.h"
+
+extern Link *link;
+void setup(void);
+void loop(void);
+
+// The handshake pins, as in link.cpp.  STROBE is also wired to
+// STROBE_INT_PIN for builds with INTERRUPT_RECEIVE.
+
+#define DIRECTION 47
+#define STROBE 48
+#define ACK 49
+#define STROBE_INT_PIN  2
+
+// If the sketch makes no progress for this many passes through loop() the
+// command is given up on.
+
+#define STALL_LIMIT  100000
+
+// The bytes of the command being sent and the response coming back.
+
+static std::vector<byte> command;
+static std::vector<byte> response;
+static size_t sendIndex;
+static bool sending;
+
+// The handshake the virtual host is using, where it left STROBE for the
+// toggle one, and the handshake to change to once the drive has ACKed a
+// PROTO_SET_HANDSHAKE (-1 if none).
+
+static bool toggle;
+static byte strobeLevel;
+static int switchTo = -1;
+
+static byte sizeCode = 2;
+static unsigned long commands;
+static unsigned long failures;
+static unsigned long bytesOut;          // to the drive
+static unsigned long bytesIn;           // from the drive
+
+// Time from the last byte of a command to the first byte of its response,
+// and from the first byte of the command to the end of the response.
+
+static double sentTime;
+static double firstByteTime;
+static unsigned long answered;          // commands with a response
+static double commandTime;
+
+static void ackChanged(int pin, int value);
+static void toggleAckChanged(int value);
+static void receivedByte(void);
+static void setStrobe(int value);
+static bool runLine(char *line, unsigned long step, bool show);
+static bool transact(void);
+static void quiet(unsigned long ms);
+static bool cardCheck(const char *name, unsigned long sector, unsigned long sectors, unsigned size);
+static bool flexCheck(byte drive, unsigned tracks, unsigned sectors, byte fill);
+static bool readFlexSector(byte drive, unsigned sectors, byte track, byte sector, byte *buf);
+static bool flexFailed(const char *why, byte track, byte sector);
+static void addLong(unsigned long value);
+static byte pattern(unsigned long sector, unsigned i);
+static double now(void);
+
+
+
+
+//=============================================================================
+
+int main(int argc, char **argv)
+{
+        int opt;
+
+        while ((opt = getopt(argc, argv, "q")) != -1)
+        {
+                switch (opt)
+                {
+                        case 'q':
+                                serialQuiet = true;
+                                break;
+
+                        default:
+                                fprintf(stderr, "usage: vhost [-q] directory [script]\n");
+                                return 1;
+                }
+        }
+        if (argc - optind < 1 || argc - optind > 2)
+        {
+                fprintf(stderr, "usage: vhost [-q] directory [script]\n");
+                return 1;
+        }
+
+        FILE *script = stdin;
+        if (argc - optind == 2 && (script = fopen(argv[optind + 1], "r")) == NULL)
+        {
+                perror(argv[optind + 1]);
+                return 1;
+        }
+        if (!SD.setCard(argv[optind]))
+        {
+                perror(argv[optind]);
+                return 1;
+        }
+
+        hostPinWritten = ackChanged;
+        setup();
+
+        char line[200];
+        double start = now();
+        hostPinAccesses = 0;
+
+        while (fgets(line, sizeof(line), script))
+        {
+                char *cptr = line + strspn(line, " \t");
+
+                if (*cptr == '#' || *cptr == '\n' || *cptr == '\0')
+                {
+                        continue;
+                }
+                if (strncmp(cptr, "repeat", 6) == 0)
+                {
+                        unsigned long count = 0;
+                        unsigned long step = 0;
+                        int used = 0;
+
+                        sscanf(cptr, "repeat %lu %lu %n", &count, &step, &used);
+                        printf("> %s", cptr);
+                        for (unsigned long i = 0; i < count && used; i++)
+                        {
+                                char copy[sizeof(line)];
+
+                                strcpy(copy, cptr + used);
+                                if (!runLine(copy, i * step, false))
+                                {
+                                        break;
+                                }
+                        }
+                }
+                else
+                {
+                        runLine(cptr, 0, true);
+                }
+        }
+
+        double seconds = now() - start;
+
+        // Every Event should be back in the pool, apart from the Link's two
+        // stream buffers.
+
+        link->showEventStats();
+        printf("\n%lu commands in %.3f seconds, %.0f commands/s, %lu failed\n",
+               commands, seconds, seconds > 0 ? commands / seconds : 0.0, failures);
+        printf("%lu bytes to the drive, %lu from it, %.1f KB/s over the link\n",
+               bytesOut, bytesIn, seconds > 0 ? (bytesOut + bytesIn) / seconds / 1024 : 0.0);
+        printf("%.1f pin reads and writes per byte\n",
+               (bytesOut + bytesIn) ? (double)hostPinAccesses / (bytesOut + bytesIn) : 0.0);
+        printf("%.1f us to the first byte of a response, %.1f us per command\n",
+               answered ? firstByteTime * 1e6 / answered : 0.0,
+               commands ? commandTime * 1e6 / commands : 0.0);
+        return failures ? 1 : 0;
+}
+
+
+
+
+//=============================================================================
+// Builds one command from a script line, sends it and checks the response.
+// Step is added to the sector number.  Returns false if it failed.
+
+static bool runLine(char *line, unsigned long step, bool show)
+{
+        char *words[8];
+        int count = 0;
+        char *cptr = strtok(line, " \t\n");
+        bool expectFail = false;
+
+        while (cptr && count < 8)
+        {
+                words[count++] = cptr;
+                cptr = strtok(NULL, " \t\n");
+        }
+        if (count > 1 && strcmp(words[0], "not") == 0)
+        {
+                expectFail = true;
+                for (int i = 1; i < count; i++)
+                {
+                        words[i - 1] = words[i];
+                }
+                count--;
+        }
+
+        unsigned long drive = (count > 1) ? strtoul(words[1], NULL, 0) : 0;
+        unsigned long sector = (count > 2) ? strtoul(words[2], NULL, 0) + step : 0;
+        unsigned long sectors = (count > 3) ? strtoul(words[3], NULL, 0) : 1;
+        unsigned size = 64U << sizeCode;
+        bool check = false;
+        bool ok = false;
+
+        if (sectors < 1 || sectors > 256)
+        {
+                sectors = 1;
+        }
+
+        command.clear();
+        if (strcmp(words[0], "size") == 0 && count == 2)
+        {
+                sizeCode = drive;
+                return true;
+        }
+        else if (strcmp(words[0], "mount") == 0 && count >= 3)
+        {
+                command.push_back(PROTO_MOUNT);
+                command.push_back(drive);
+                command.push_back((count > 3) ? strtoul(words[3], NULL, 0) : 0);
+                command.insert(command.end(), words[2], words[2] + strlen(words[2]) + 1);
+        }
+        else if (strcmp(words[0], "unmount") == 0 && count == 2)
+        {
+                command.push_back(PROTO_UNMOUNT);
+                command.push_back(drive);
+        }
+        else if ((strcmp(words[0], "read") == 0 || strcmp(words[0], "check") == 0) && count >= 3)
+        {
+                check = (words[0][0] == 'c');
+                command.push_back((sectors == 1) ? PROTO_READ_SECTOR_LONG : PROTO_READ_MULTI_LONG);
+                command.push_back(drive);
+                command.push_back(sizeCode);
+                addLong(sector);
+                if (sectors > 1)
+                {
+                        command.push_back(sectors & 0xff);
+                }
+        }
+        else if (strcmp(words[0], "write") == 0 && count >= 3)
+        {
+                command.push_back((sectors == 1) ? PROTO_WRITE_SECTOR_LONG : PROTO_WRITE_MULTI_LONG);
+                command.push_back(drive);
+                command.push_back(sizeCode);
+                addLong(sector);
+                if (sectors > 1)
+                {
+                        command.push_back(sectors & 0xff);
+                }
+                for (unsigned long s = 0; s < sectors; s++)
+                {
+                        for (unsigned i = 0; i < size; i++)
+                        {
+                                command.push_back(pattern(sector + s, i));
+                        }
+                }
+        }
+        else if (strcmp(words[0], "done") == 0)
+        {
+                command.push_back(PROTO_DONE);
+        }
+        else if (strcmp(words[0], "ping") == 0)
+        {
+                command.push_back(PROTO_PING);
+        }
+        else if (strcmp(words[0], "stats") == 0)
+        {
+                command.push_back(PROTO_GET_STATS);
+        }
+        else if (strcmp(words[0], "dir") == 0)
+        {
+                command.push_back(PROTO_GET_DIR);
+        }
+        else if (strcmp(words[0], "mounted") == 0)
+        {
+                command.push_back(PROTO_GET_MOUNTED_LIST);
+        }
+        else if (strcmp(words[0], "version") == 0)
+        {
+                command.push_back(PROTO_VERSION);
+        }
+        else if (strcmp(words[0], "handshake") == 0 && count == 2)
+        {
+                command.push_back(PROTO_SET_HANDSHAKE);
+                command.push_back(drive);
+        }
+        else if (strcmp(words[0], "quiet") == 0 && count == 2)
+        {
+                quiet(strtoul(words[1], NULL, 0));
+                ok = true;
+        }
+        else if ((strcmp(words[0], "merge") == 0 || strcmp(words[0], "discard") == 0) && count == 2)
+        {
+                command.push_back(PROTO_OVERLAY);
+                command.push_back(drive);
+                command.push_back((words[0][0] == 'm') ? 1 : 0);
+        }
+        else if (strcmp(words[0], "overlay") == 0 && count == 3)
+        {
+                command.push_back(PROTO_OVERLAY);
+                command.push_back(drive);
+                command.push_back(sector);
+        }
+        else if (strcmp(words[0], "convert") == 0 && count >= 2)
+        {
+                command.push_back(PROTO_CONVERT);
+                command.push_back((count > 2) ? strtoul(words[2], NULL, 0) : 0);
+                command.push_back((count > 3) ? strtoul(words[3], NULL, 0) : 0);
+                command.insert(command.end(), words[1], words[1] + strlen(words[1]) + 1);
+        }
+        else if (strcmp(words[0], "format") == 0 && count >= 4)
+        {
+                command.push_back(PROTO_FORMAT);
+                command.push_back(strtoul(words[2], NULL, 0) & 0xff);    // 256 is sent as 0
+                command.push_back(strtoul(words[3], NULL, 0));
+                command.push_back((count > 4) ? strtoul(words[4], NULL, 0) : 0);
+                command.push_back((count > 5) ? strtoul(words[5], NULL, 0) : 0);
+                command.insert(command.end(), words[1], words[1] + strlen(words[1]) + 1);
+        }
+        else if (strcmp(words[0], "card") == 0 && count >= 3)
+        {
+                ok = cardCheck(words[1], sector, sectors, size);
+                response.clear();
+        }
+        else if (strcmp(words[0], "flexcheck") == 0 && count >= 4)
+        {
+                // This one sends its own reads, so there's no command
+                // left to send afterwards.
+                
+                ok = flexCheck(drive, strtoul(words[2], NULL, 0), strtoul(words[3], NULL, 0),
+                               (count > 4) ? strtoul(words[4], NULL, 0) : 0);
+                command.clear();
+                response.clear();
+        }
+        else
+        {
+                printf("?? %s\n", words[0]);
+                failures++;
+                return false;
+        }
+
+        if (!command.empty())
+        {
+                ok = transact();
+        }
+
+        // Reads come back as one PROTO_SECTOR_DATA per sector, or a NAK
+        // where it went wrong.  Anything else is fine unless it's a NAK.
+
+        if (ok && !command.empty() && (command[0] == PROTO_READ_SECTOR_LONG || command[0] == PROTO_READ_MULTI_LONG))
+        {
+                size_t index = 0;
+
+                for (unsigned long s = 0; s < sectors && ok; s++)
+                {
+                        ok = (index + 1 + size <= response.size() && response[index] == PROTO_SECTOR_DATA);
+                        for (unsigned i = 0; ok && check && i < size; i++)
+                        {
+                                ok = (response[index + 1 + i] == pattern(sector + s, i));
+                        }
+                        index += 1 + size;
+                }
+        }
+        else if (ok && !command.empty() && (command[0] == PROTO_GET_DIR || command[0] == PROTO_GET_MOUNTED_LIST))
+        {
+                ok = (response.size() > 0 && response[0] != PROTO_NAK && response.back() == PROTO_DIR_END);
+        }
+        else if (ok && response.size() > 0)
+        {
+                ok = (response[0] != PROTO_NAK);
+        }
+
+        if (expectFail)
+        {
+                ok = !ok;
+        }
+
+        if (show || !ok)
+        {
+                printf("> %s%s", expectFail ? "not " : "", words[0]);
+                for (int i = 1; i < count; i++)
+                {
+                        printf(" %s", words[i]);
+                }
+                printf(": %s, %zu bytes back", ok ? "ok" : "FAILED", response.size());
+                if (response.size() >= 2 && response[0] == PROTO_NAK)
+                {
+                        printf(", NAK code %u", response[1]);
+                }
+                printf("\n");
+        }
+
+        commands++;
+        if (!ok)
+        {
+                failures++;
+        }
+        return ok;
+}
+
+
+
+
+//=============================================================================
+// Sends the command and runs the sketch until it has been taken in, handled
+// and answered.  Returns false if the sketch stopped making progress.
+
+static bool transact(void)
+{
+        unsigned long stalls = 0;
+        double start = now();
+
+        response.clear();
+        sendIndex = 0;
+        sending = true;
+        hostSetInput(DIRECTION, HIGH);     // the host is driving the bus
+        PINC = command[0];
+        setStrobe(toggle ? !strobeLevel : HIGH);
+
+        while (sending || !link->isIdle())
+        {
+                size_t before = sendIndex + response.size();
+
+                loop();
+                if (sendIndex + response.size() != before)
+                {
+                        stalls = 0;
+                }
+                else if (++stalls > STALL_LIMIT)
+                {
+                        sending = false;
+                        hostSetInput(DIRECTION, LOW);
+                        setStrobe(LOW);
+                        return false;
+                }
+        }
+
+        bytesOut += command.size();
+        bytesIn += response.size();
+        commandTime += now() - start;
+        return true;
+}
+
+
+
+
+//=============================================================================
+// Leaves the link alone for ms milliseconds while the sketch runs.  If that's
+// long enough for the drive to give up on the toggle handshake, the host
+// does too.  Should the drive drop ACK to get there, the four phase side of
+// ackChanged() drops STROBE to match.
+
+static void quiet(unsigned long ms)
+{
+        unsigned long start = millis();
+
+        if (ms >= HANDSHAKE_TIMEOUT)
+        {
+                toggle = false;
+        }
+        while (millis() - start < ms)
+        {
+                loop();
+        }
+}
+
+
+
+
+//=============================================================================
+// Reads sectors straight from an image file in the card directory, which
+// is the current one, so a write still sitting in the sketch's cache doesn't
+// count.  Returns true if they hold the pattern write puts there.
+
+static bool cardCheck(const char *name, unsigned long sector, unsigned long sectors, unsigned size)
+{
+        std::vector<byte> buf(size);
+        bool ok = true;
+        FILE *fp = fopen(name, "rb");
+        if (fp == NULL || fseek(fp, sector * size, SEEK_SET) != 0)
+        {
+                ok = false;
+        }
+        for (unsigned long s = 0; ok && s < sectors; s++)
+        {
+                ok = (fread(&buf[0], 1, size, fp) == size);
+                for (unsigned i = 0; ok && i < size; i++)
+                {
+                        ok = (buf[i] == pattern(sector + s, i));
+                }
+        }
+        if (fp != NULL)
+        {
+                fclose(fp);
+        }
+        return ok;
+}
+
+
+
+
+//=============================================================================
+// Walks a FLEX disk the way FLEX itself would, reading a sector at a time
+// over the link, and checks it's what a format of tracks x sectors filled
+// with fill should have made: the SIR, the directory sectors on track 0
+// linked in order and empty, and the free chain going through every other
+// sector, as long as the SIR says, ending where it says.  Returns false
+// after saying what was wrong.
+
+static bool flexCheck(byte drive, unsigned tracks, unsigned sectors, byte fill)
+{
+        byte buf[FLEX_SECTOR_SIZE];
+        unsigned long freeCount = (unsigned long)(tracks - 1) * sectors;
+
+        if (tracks < 2 || tracks > 256 || sectors < FLEX_DIR_SECTOR || sectors > FLEX_MAX_SECTORS)
+        {
+                return flexFailed("not a FLEX geometry", 0, 0);
+        }
+
+        if (!readFlexSector(drive, sectors, 0, FLEX_SIR_SECTOR, buf))
+        {
+                return flexFailed("can't read the SIR", 0, FLEX_SIR_SECTOR);
+        }
+        if (buf[SIR_MAX_TRACK] != tracks - 1 || buf[SIR_MAX_SECTOR] != sectors)
+        {
+                return flexFailed("SIR has the wrong size", 0, FLEX_SIR_SECTOR);
+        }
+        if (buf[SIR_FIRST_FREE] != 1 || buf[SIR_FIRST_FREE + 1] != FLEX_FIRST_SECTOR ||
+            buf[SIR_LAST_FREE] != tracks - 1 || buf[SIR_LAST_FREE + 1] != sectors)
+        {
+                return flexFailed("SIR has the wrong free chain", 0, FLEX_SIR_SECTOR);
+        }
+        if ((unsigned long)((buf[SIR_FREE_COUNT] << 8) | buf[SIR_FREE_COUNT + 1]) != freeCount)
+        {
+                return flexFailed("SIR has the wrong free count", 0, FLEX_SIR_SECTOR);
+        }
+
+        byte lastTrack = buf[SIR_LAST_FREE];
+        byte lastSector = buf[SIR_LAST_FREE + 1];
+        byte track = 0;
+        byte sector = FLEX_DIR_SECTOR;
+        unsigned dirSectors = 0;
+
+        while (track != 0 || sector != 0)
+        {
+                if (track != 0 || sector != FLEX_DIR_SECTOR + dirSectors)
+                {
+                        return flexFailed("directory chain out of order", track, sector);
+                }
+                if (!readFlexSector(drive, sectors, track, sector, buf))
+                {
+                        return flexFailed("can't read the directory", track, sector);
+                }
+                for (unsigned i = 2; i < FLEX_SECTOR_SIZE; i++)
+                {
+                        if (buf[i] != 0)
+                        {
+                                return flexFailed("directory isn't empty", track, sector);
+                        }
+                }
+                dirSectors++;
+                track = buf[0];
+                sector = buf[1];
+        }
+        if (dirSectors != sectors - FLEX_DIR_SECTOR + 1)
+        {
+                return flexFailed("directory chain too short", 0, FLEX_DIR_SECTOR + dirSectors);
+        }
+
+        unsigned long freeSectors = 0;
+        byte prevTrack = 0;
+        byte prevSector = 0;
+
+        track = 1;
+        sector = FLEX_FIRST_SECTOR;
+        while (track != 0 || sector != 0)
+        {
+                if (track >= tracks || sector < FLEX_FIRST_SECTOR || sector > sectors ||
+                    ++freeSectors > freeCount)
+                {
+                        return flexFailed("free chain goes astray", track, sector);
+                }
+                if (!readFlexSector(drive, sectors, track, sector, buf))
+                {
+                        return flexFailed("can't read the free chain", track, sector);
+                }
+                for (unsigned i = 4; i < FLEX_SECTOR_SIZE; i++)
+                {
+                        if (buf[i] != fill)
+                        {
+                                return flexFailed("free sector not filled", track, sector);
+                        }
+                }
+                prevTrack = track;
+                prevSector = sector;
+                track = buf[0];
+                sector = buf[1];
+        }
+        if (freeSectors != freeCount || prevTrack != lastTrack || prevSector != lastSector)
+        {
+                return flexFailed("free chain ends early", prevTrack, prevSector);
+        }
+
+        printf("%u directory sectors, %lu free sectors\n", dirSectors, freeSectors);
+        return true;
+}
+
+
+
+
+//=============================================================================
+// Reads one 256 byte sector of a FLEX disk into buf.  Sectors are numbered
+// from 1 on every track.
+
+static bool readFlexSector(byte drive, unsigned sectors, byte track, byte sector, byte *buf)
+{
+        command.clear();
+        command.push_back(PROTO_READ_SECTOR_LONG);
+        command.push_back(drive);
+        command.push_back(DEFAULT_SECTOR_CODE);
+        addLong((unsigned long)track * sectors + sector - FLEX_FIRST_SECTOR);
+        if (!transact() || response.size() != 1 + FLEX_SECTOR_SIZE || response[0] != PROTO_SECTOR_DATA)
+        {
+                return false;
+        }
+        memcpy(buf, &response[1], FLEX_SECTOR_SIZE);
+        return true;
+}
+
+
+
+
+//=============================================================================
+
+static bool flexFailed(const char *why, byte track, byte sector)
+{
+        printf("flexcheck: %s at %u/%u\n", why, track, sector);
+        return false;
+}
+
+
+
+
+//=============================================================================
+// Called whenever the sketch writes a pin.  ACK is the only one the host
+// watches.  While sending, ACK going high means the byte was taken, so STROBE
+// drops, and ACK going low means the next byte can go out.  While receiving,
+// ACK going high means a byte is on the bus, which STROBE acknowledges.  With
+// the toggle handshake any change of ACK does the same as both of those.
+
+static void ackChanged(int pin, int value)
+{
+        if (pin != ACK)
+        {
+                return;
+        }
+
+        if (toggle)
+        {
+                toggleAckChanged(value);
+        }
+        else if (sending)
+        {
+                if (value == HIGH)
+                {
+                        setStrobe(LOW);
+                }
+                else if (++sendIndex < command.size())
+                {
+                        PINC = command[sendIndex];
+                        setStrobe(HIGH);
+                }
+                else
+                {
+                        sending = false;
+                        sentTime = now();
+                        hostSetInput(DIRECTION, LOW);      // ready for the response
+                }
+        }
+        else
+        {
+                if (value == HIGH)
+                {
+                        receivedByte();
+                        setStrobe(HIGH);
+                }
+                else
+                {
+                        setStrobe(LOW);
+                        if (switchTo == HANDSHAKE_TOGGLE)
+                        {
+                                toggle = true;
+                                switchTo = -1;
+                        }
+                }
+        }
+}
+
+
+
+
+//=============================================================================
+// The toggle handshake.  The lines are even when ACK matches STROBE.  If the
+// drive left them high when going back to four phase, it drops ACK and then
+// STROBE can go low too.
+
+static void toggleAckChanged(int value)
+{
+        if (switchTo == HANDSHAKE_FOUR_PHASE)
+        {
+                setStrobe(LOW);
+                toggle = false;
+                switchTo = -1;
+        }
+        else if (sending)
+        {
+                if (value != strobeLevel)
+                {
+                        return;
+                }
+                if (++sendIndex < command.size())
+                {
+                        PINC = command[sendIndex];
+                        setStrobe(!strobeLevel);
+                }
+                else
+                {
+                        sending = false;
+                        sentTime = now();
+                        hostSetInput(DIRECTION, LOW);      // ready for the response
+                }
+        }
+        else if (value != strobeLevel)
+        {
+                receivedByte();
+                setStrobe(value);
+                if (switchTo == HANDSHAKE_FOUR_PHASE && strobeLevel == LOW)
+                {
+                        toggle = false;         // already where four phase starts
+                        switchTo = -1;
+                }
+        }
+}
+
+
+
+
+//=============================================================================
+// Keeps a byte of the response.  An ACK for PROTO_SET_HANDSHAKE means the
+// drive is changing handshakes once this byte is done.
+
+static void receivedByte(void)
+{
+        byte value = PORTC;
+
+        if (response.empty())
+        {
+                firstByteTime += now() - sentTime;
+                answered++;
+        }
+        response.push_back(value);
+        if (response.size() == 1 && value == PROTO_ACK && command[0] == PROTO_SET_HANDSHAKE &&
+            (command[1] == HANDSHAKE_TOGGLE) != toggle)
+        {
+                switchTo = command[1];
+        }
+}
+
+
+
+
+//=============================================================================
+
+static void setStrobe(int value)
+{
+        strobeLevel = value ? HIGH : LOW;
+        hostSetInput(STROBE, value);
+        hostSetInput(STROBE_INT_PIN, value);
+}
+
+
+
+
+//=============================================================================
+// Adds a long to the command, MSB first.
+
+static void addLong(unsigned long value)
+{
+        for (int shift = 24; shift >= 0; shift -= 8)
+        {
+                command.push_back((value >> shift) & 0xff);
+        }
+}
+
+
+
+
+//=============================================================================
+// The data write puts in each sector, different for every sector so a read
+// of the wrong one shows up.
+
+static byte pattern(unsigned long sector, unsigned i)
+{
+        return (byte)(sector * 7 + i);
+}
+
+
+
+
+//=============================================================================
+
+static double now(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+}
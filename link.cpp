@@ -10,9 +10,8 @@
 // This is the only class that knows anything about the low level transport
 // mechanism, everything else deals with Event objects.
 //
-// This class also maintains the list of free Events.  This should probably
-// be moved into another class, but works fine here for this simplistic
-// system.
+// This class also owns the pool of free Events (see EventPool.h) and hands
+// them out to everything else.
 //
 // August 2014 - Bob Applegate, bob@corshamtech.com
 //
@@ -29,6 +28,17 @@
 // ACK       - To the master.  This is our ACK when the master is sending us
 //             data, or a strobe to the host when we're sending data.
 //
+// Normally each byte takes four changes: STROBE up, ACK up, STROBE down, ACK
+// down (the other way around when we send).  A host can switch to the toggle
+// handshake with PROTO_SET_HANDSHAKE, where each byte takes two.  The lines
+// are "even" when STROBE and ACK are at the same level.  The host sends a
+// byte by flipping STROBE, making them uneven, and we take it by flipping
+// ACK to match.  We send by flipping ACK and the host flips STROBE once it
+// has the byte.  On the way back to four phase, if the lines are left high
+// we drop ACK after the reply and wait for the host to drop STROBE.  The
+// same happens by itself if the link is quiet for HANDSHAKE_TIMEOUT while
+// using toggles, so a host that rebooted finds the drive using four phase.
+//
 // This is a very basic mapping of ports between the processors
 //
 // 653x  6821   Arduino   Use
@@ -54,6 +64,8 @@
 //       A5     a5  pc5   DATA 5
 
 #include "link.h"
+#include "Latency.h"
+#include "Errors.h"
 #include <Arduino.h>
 
 // Various debug options.  These should all be left as undefined or
@@ -63,7 +75,9 @@
 
 extern unsigned getSectorSize(byte code);
 
-#define PROTOCOL_VERSION 1
+// 2 added PROTO_SET_HANDSHAKE.
+
+#define PROTOCOL_VERSION 2
 
 extern bool debounceInputPin(int pin);
 
@@ -87,6 +101,65 @@ extern bool debounceInputPin(int pin);
 #define STROBE 48
 #define ACK 49
 
+// Define to move the handshake lines with the port registers instead of
+// digitalRead() and digitalWrite().  Each of those looks the pin up in tables
+// and checks for PWM before touching the port, and the old code did five
+// reads per test of STROBE, which limited the link to a small part of what
+// the host can do.  Pins 47, 48 and 49 are bits 2, 1 and 0 of port L on the
+// Mega.  host/Makefile can build it without, to compare the two.
+
+#ifndef PORTABLE_HANDSHAKE
+#define FAST_HANDSHAKE
+#endif
+
+// Number of reads in a row that must agree before a handshake input is
+// believed.  1 turns debouncing off; raise it if the cable is noisy.
+
+#define HANDSHAKE_SAMPLES  2
+
+// Define to take bytes from the host in an interrupt, so the host can keep
+// sending while the main loop is busy with the card, such as during a
+// streamed write.  The interrupt does the whole handshake and leaves the
+// bytes in a ring buffer for poll() to hand to the state machine.  Port L has
+// no pin change interrupts, so STROBE must also be wired to STROBE_INT_PIN,
+// one of the external interrupt pins; that's why this is off by default.
+// Pin 2 is the only free one: 19 is the card detect, 20 and 21 are the I2C
+// bus to the clock and 18 may be jumpered to the timer output.
+
+//#define INTERRUPT_RECEIVE
+
+#define STROBE_INT_PIN  2
+#define RX_RING_SIZE  64        // must be a power of two
+
+// With the STROBE interrupt in place, the sectors of a multi-sector read can
+// be sent from it too, so the next sector comes off the card while the host
+// is still taking the last one.  See queueResponsePart().
+
+#ifdef INTERRUPT_RECEIVE
+#define PIPELINED_READS
+#endif
+
+#ifdef FAST_HANDSHAKE
+#define HANDSHAKE_IN  PINL
+#define HANDSHAKE_OUT  PORTL
+#define DIRECTION_BIT  0x04
+#define STROBE_BIT  0x02
+#define ACK_BIT  0x01
+
+#define STROBE_IS_HIGH()  readHandshake(STROBE_BIT)
+#define DIRECTION_IS_HIGH()  readHandshake(DIRECTION_BIT)
+#define RAISE_ACK()  (HANDSHAKE_OUT |= ACK_BIT)
+#define LOWER_ACK()  (HANDSHAKE_OUT &= ~ACK_BIT)
+#else
+#define STROBE_IS_HIGH()  debounceInputPin(STROBE)
+#define DIRECTION_IS_HIGH()  debounceInputPin(DIRECTION)
+#define RAISE_ACK()  digitalWrite(ACK, HIGH)
+#define LOWER_ACK()  digitalWrite(ACK, LOW)
+#endif
+
+#define TOGGLE_ACK()  do { if ((ackHigh = !ackHigh)) RAISE_ACK(); else LOWER_ACK(); } while (0)
+#define LINES_EVEN()  (STROBE_IS_HIGH() == ackHigh)
+
 
 
 // The possible states for the inbound state machine:
@@ -101,12 +174,258 @@ typedef enum
         STATE_GET_FOUR,
         STATE_GET_FIVE,
         STATE_GET_SIX,
+        STATE_GET_SEVEN,
         STATE_GET_DRV_NUMBER_TO_MOUNT,
         STATE_GET_DRV_NAME,  // get drive number
         STATE_APPEND_SECTOR, // add sector data to end
         STATE_GET_LENGTH,
+        STATE_STREAM_SECTOR, // sector data for a streamed write
+        STATE_GET_PREFIX,    // count bytes, then a filename
 } STATE;
 
+// Current state of the inbound state machine.
+
+static STATE state = STATE_CMD;
+
+// For streamed writes, the number of sectors still to come, the size of each
+// one and which of the two stream buffers is being filled.
+
+static unsigned int streamSectors;
+static unsigned int streamSize;
+static byte streamFill;
+
+// A command that arrives when the pool has no Event for it still has to be
+// taken in, or its argument bytes would be read as commands.  It goes
+// through the usual states in this Event instead, which only has room for
+// the header bytes the states look at; the rest are dropped.  When the
+// command is complete the Link NAKs it with ERR_NO_MEMORY itself.
+
+#define DISCARD_SIZE  8
+
+static Event discardEvent;
+static byte discardBuffer[DISCARD_SIZE];
+
+// True when using the toggle handshake, and where ACK was left.  The four
+// phase handshake always leaves ACK low.
+
+static volatile bool toggleMode;
+static volatile bool ackHigh;
+
+// Set when the toggle handshake timed out with the lines high.  ACK has been
+// dropped, and nothing from the host counts until it drops STROBE too; then
+// the four phase handshake takes over.
+
+static volatile bool fallingBack;
+
+#ifdef INTERRUPT_RECEIVE
+// Bytes from the host.  Only the interrupt moves rxHead and only poll() moves
+// rxTail, so neither needs interrupts turned off.  If the ring is full the
+// interrupt leaves the byte on the bus without an ACK and sets rxStalled;
+// the host waits until poll() makes room and takes it.
+
+static volatile byte rxRing[RX_RING_SIZE];
+static volatile byte rxHead;
+static volatile byte rxTail;
+static volatile bool rxStalled;
+static volatile bool rxEnabled;         // false while sending to the host
+static volatile bool rxAcked;           // ACK is up for the last byte
+
+static void strobeChanged(void);
+#endif
+
+#ifdef PIPELINED_READS
+// A message being sent by the interrupt: the type byte, if it hasn't gone
+// yet, then txLeft bytes from txData.  txActive drops once the host has taken
+// the last one.
+
+static volatile bool txActive;
+static volatile bool txAcked;           // four phase: ACK is up
+static byte txHeader;
+static byte *txData;
+static unsigned txLeft;
+
+static void sendChanged(void);
+static void sendNext(void);
+#endif
+
+#ifdef LATENCY_HISTOGRAMS
+// When the first byte of the message being received arrived, and when the
+// response being sent was started.
+
+static unsigned long rxStart;
+static bool rxTiming;
+static unsigned long txStart;
+#endif
+
+
+
+#ifdef FAST_HANDSHAKE
+//=============================================================================
+// Reads one of the handshake inputs straight from the port, HANDSHAKE_SAMPLES
+// times in a row if debouncing.  Returns true if it's high.
+
+static inline bool readHandshake(byte bit)
+{
+        byte last = HANDSHAKE_IN & bit;
+
+        for (byte good = 1; good < HANDSHAKE_SAMPLES; )
+        {
+                byte now = HANDSHAKE_IN & bit;
+                if (now == last)
+                {
+                        good++;
+                }
+                else
+                {
+                        last = now;
+                        good = 1;
+                }
+        }
+        return last != 0;
+}
+#endif
+
+
+
+
+#ifdef INTERRUPT_RECEIVE
+//=============================================================================
+// Interrupt handler for both edges of STROBE.  A rising edge is a new byte:
+// latch it, ACK it and put it in the ring.  A falling edge means the host
+// saw the ACK, so drop it.  Nothing happens while a response is going out,
+// since writeByte() does that handshake itself.
+
+static void strobeChanged(void)
+{
+#ifdef PIPELINED_READS
+        if (txActive)
+        {
+                sendChanged();
+                return;
+        }
+#endif
+        if (!rxEnabled || fallingBack)
+        {
+                return;
+        }
+
+        if (toggleMode)
+        {
+                // Any change of STROBE is a new byte.
+
+                byte next = (rxHead + 1) & (RX_RING_SIZE - 1);
+                if (LINES_EVEN())
+                {
+                        return;
+                }
+                if (next == rxTail)
+                {
+                        rxStalled = true;
+                        return;
+                }
+                rxRing[rxHead] = LOWER_READ;
+                rxHead = next;
+                TOGGLE_ACK();
+        }
+        else if (STROBE_IS_HIGH())
+        {
+                byte next = (rxHead + 1) & (RX_RING_SIZE - 1);
+                if (rxAcked)
+                {
+                        return;         // already have this one
+                }
+                if (next == rxTail)
+                {
+                        rxStalled = true;
+                        return;
+                }
+                rxRing[rxHead] = LOWER_READ;
+                rxHead = next;
+                RAISE_ACK();
+                rxAcked = true;
+        }
+        else if (rxAcked)
+        {
+                LOWER_ACK();
+                rxAcked = false;
+        }
+}
+#endif
+
+
+
+
+#ifdef PIPELINED_READS
+//=============================================================================
+// STROBE changed while the interrupt is sending.  This is writeByte() turned
+// inside out: once the host has taken the byte on the bus, the next goes out.
+
+static void sendChanged(void)
+{
+        if (toggleMode)
+        {
+                if (!LINES_EVEN())
+                {
+                        return;         // host hasn't taken it yet
+                }
+        }
+        else if (txAcked)
+        {
+                if (STROBE_IS_HIGH())
+                {
+                        LOWER_ACK();
+                        txAcked = false;
+                }
+                return;
+        }
+        else if (STROBE_IS_HIGH())
+        {
+                return;
+        }
+        sendNext();
+}
+
+
+
+
+//=============================================================================
+// Puts the next byte of the message on the bus, or finishes if there are no
+// more.  Called with interrupts off.
+
+static void sendNext(void)
+{
+        byte data;
+
+        if (txHeader)
+        {
+                data = txHeader;
+                txHeader = 0;
+        }
+        else if (txLeft)
+        {
+                data = *txData++;
+                txLeft--;
+        }
+        else
+        {
+                txActive = false;
+                return;
+        }
+
+        LOWER_WRITE = data;
+        if (toggleMode)
+        {
+                TOGGLE_ACK();
+        }
+        else
+        {
+                RAISE_ACK();
+                txAcked = true;
+        }
+}
+#endif
+
+
 
 
 //=============================================================================
@@ -127,6 +446,11 @@ Link::Link(void)
 void Link::begin(void)
 {
         hasEvent = false;
+        nextHandshake = HANDSHAKE_FOUR_PHASE;
+        toggleMode = false;
+        ackHigh = false;
+        fallingBack = false;
+        lastToggle = 0;
         
         // Set the ACK to output, DIRECTION and STROBE to input
         
@@ -141,9 +465,19 @@ void Link::begin(void)
         
         Serial.println("LINK is initialized");
         
-        // Make sure we've got an event
+        event = NULL;
+        
+        // Streamed writes fill one buffer while the main loop writes the
+        // other one to the disk.  These are never given back to the pool.
         
-        freeEvent = new Event();
+        streamEvent[0] = getAnEvent();
+        streamEvent[1] = getAnEvent();
+        discardEvent.attach(discardBuffer, DISCARD_SIZE);
+
+#ifdef INTERRUPT_RECEIVE
+        pinMode(STROBE_INT_PIN, INPUT);
+        attachInterrupt(digitalPinToInterrupt(STROBE_INT_PIN), strobeChanged, CHANGE);
+#endif
 }
 
 
@@ -170,17 +504,38 @@ bool Link::poll(void)
 {
         word data;
   
-        // Strobe goes high if the host has put data on the data pins.  Something
-        // to consider for a future fix is a timeout here.  If the STROBE line is
-        // floating then the code might get stuck here forever waiting for a byte
-        // to arrive.
+#ifdef INTERRUPT_RECEIVE
+        // The interrupt has already taken the bytes from the host, so hand
+        // them to the state machine until a message is complete.  The rest
+        // wait in the ring for the next call.
+
+        while (!hasEvent && rxTail != rxHead)
+#else
+        // Strobe goes high if the host has put data on the data pins, or
+        // changes at all with the toggle handshake.  Something to consider
+        // for a future fix is a timeout here.  If the STROBE line is
+        // floating then the code might get stuck here forever waiting for a
+        // byte to arrive.
         
-        if (debounceInputPin(STROBE))
+        if (!fallingBack && (toggleMode ? !LINES_EVEN() : STROBE_IS_HIGH()))
+#endif
         {
+#ifdef LATENCY_HISTOGRAMS
+                if (!rxTiming)
+                {
+                        rxStart = micros();
+                        rxTiming = true;
+                }
+#endif
+#ifdef INTERRUPT_RECEIVE
+                data = rxRing[rxTail];
+                rxTail = (rxTail + 1) & (RX_RING_SIZE - 1);
+#else
                 // There is a strobe, so get the byte from the host and
                 // then send it to the state machine for processing.
                 
                 data = readByte();
+#endif
                 
                 //Serial.print("Got byte: ");
                 //Serial.println((byte)data, HEX);
@@ -188,8 +543,37 @@ bool Link::poll(void)
                 // Let the state machine process the byte of data.
                 
                 stateMachine(data);
+#ifdef LATENCY_HISTOGRAMS
+                if (hasEvent)
+                {
+                        latencyCommand(event->getType());
+                        latencyRecord(LAT_RECEIVE, rxStart);
+                        rxTiming = false;
+                }
+#endif
+                if (toggleMode)
+                {
+                        lastToggle = millis();
+                }
+        }
+
+#ifdef INTERRUPT_RECEIVE
+        // If the ring filled up, the host is still holding a byte.  Take it
+        // now that there may be room.
+
+        if (rxStalled)
+        {
+                noInterrupts();
+                rxStalled = false;
+                strobeChanged();
+                interrupts();
         }
+#endif
 
+        if (toggleMode && !hasEvent)
+        {
+                checkHandshakeTimeout();
+        }
         return hasEvent;
 }
 
@@ -203,6 +587,16 @@ bool Link::poll(void)
 void Link::prepareRead(void)
 {
         LOWER_DDR = (~LOWER_MASK) & 0xff;
+
+#ifdef INTERRUPT_RECEIVE
+        // The host may have raised STROBE for its next command while the
+        // interrupt was ignoring it, so look now.
+
+        noInterrupts();
+        rxEnabled = true;
+        strobeChanged();
+        interrupts();
+#endif
 }
 
 
@@ -215,11 +609,15 @@ void Link::prepareRead(void)
 
 void Link::prepareWrite(void)
 {
+#ifdef INTERRUPT_RECEIVE
+        rxEnabled = false;      // writeByte() does its own handshake
+#endif
+
         // Before setting the data bits to output, make sure the other
         // side has indicating it's in read mode or else we might have
         // both drivers fighting each other.
         
-        while (debounceInputPin(DIRECTION))
+        while (DIRECTION_IS_HIGH())
                 ;
 
         LOWER_DDR = LOWER_MASK;
@@ -242,16 +640,26 @@ void Link::writeByte(byte data)
         // Put the byte onto the data port
         
         LOWER_WRITE = data;
+
+        if (toggleMode)
+        {
+                // Flip ACK and wait for the host to flip STROBE to match.
+
+                TOGGLE_ACK();
+                while (!LINES_EVEN())
+                        ;
+                return;
+        }
                 
         // raise ACK to indicate data is present, then wait for
         // strobe to go high
                 
-        digitalWrite(ACK, HIGH);
-        while (debounceInputPin(STROBE) == LOW)
+        RAISE_ACK();
+        while (!STROBE_IS_HIGH())
                 ;
                     
-        digitalWrite(ACK, LOW);
-        while (debounceInputPin(STROBE) == HIGH);
+        LOWER_ACK();
+        while (STROBE_IS_HIGH())
                 ;
 }
 
@@ -264,25 +672,36 @@ void Link::writeByte(byte data)
 byte Link::readByte(void)
 {
         byte data;
+
+        if (toggleMode)
+        {
+                // STROBE changing is the byte, ACK changing takes it.
+
+                while (LINES_EVEN())
+                        ;
+                data = LOWER_READ;
+                TOGGLE_ACK();
+                return data;
+        }
         
         // Wait for STROBE to go high, indicating a byte is ready.
         
-        while (debounceInputPin(STROBE) == LOW)
+        while (!STROBE_IS_HIGH())
                 ;
                 
         // Data is available, so grab it right away, then ACK it.
                 
         data = LOWER_READ;
-        digitalWrite(ACK, HIGH);
+        RAISE_ACK();
                 
         // Wait for host to lower strobe
                 
-        while (debounceInputPin(STROBE))
+        while (STROBE_IS_HIGH())
                 ;
                         
         // Lower ACK and we're done.
                 
-        digitalWrite(ACK, LOW);
+        LOWER_ACK();
 
 #ifdef DEBUG_LINK_RAW
         Serial.print("Link readByte: ");
@@ -295,6 +714,25 @@ byte Link::readByte(void)
 
 
 
+//=============================================================================
+// Returns true if the host isn't in the middle of sending a command and
+// there is no event waiting to be processed.  This is a good time to do
+// background work.
+
+bool Link::isIdle(void)
+{
+#ifdef INTERRUPT_RECEIVE
+        if (rxTail != rxHead)
+        {
+                return false;
+        }
+#endif
+        return state == STATE_CMD && !hasEvent;
+}
+
+
+
+
 //=============================================================================
 // This is used to get the next event waiting, or NULL if there is none.
 
@@ -316,7 +754,6 @@ Event *Link::getEvent(void)
 
 void Link::stateMachine(word token)
 {
-        static STATE state = STATE_CMD;
         bool transactionDone = false;  // set true if this is end of transaction
         static unsigned int count;
 
@@ -324,7 +761,10 @@ void Link::stateMachine(word token)
         switch (state)
         {
                 case STATE_CMD:
-                        // This is a command byte.
+                        // This is a command byte.  Commands that bring a
+                        // sector or a filename, or get a long reply in the
+                        // same Event, need a full sized one.  The rest only
+                        // need a small one.
                         
                         uInt->sendEvent(UI_TRANSACTION_START);
                         switch (token)
@@ -365,22 +805,19 @@ void Link::stateMachine(word token)
 #endif
 
                                 case PROTO_READ_FILE:
-                                        event = getAnEvent();
-                                        event->clean(EVT_TYPE_FILE);
+                                        event = newEvent(EVT_TYPE_FILE, BUFFER_SIZE);
                                         state = STATE_WAIT_NULL;
                                         hasEvent = false;
                                         break;
                                         
                                 case PROTO_READ_BYTES:
-                                        event = getAnEvent();
-                                        event->clean(EVT_SEND_DATA);
+                                        event = newEvent(EVT_SEND_DATA, BUFFER_SIZE);
                                         state = STATE_GET_ONE;
                                         hasEvent = false;
                                         break;
                                         
                                 case PROTO_GET_DIR:
-                                        event = getAnEvent();
-                                        event->clean(EVT_GET_DIRECTORY);
+                                        event = newEvent(EVT_GET_DIRECTORY, SMALL_EVENT_SIZE);
                                         hasEvent = true;
                                         break;
                                         
@@ -388,16 +825,14 @@ void Link::stateMachine(word token)
                                         Serial.println("Got a MOUNT");
                                         // Next is the drive number, then the read-only
                                         // flag and then the filename to mount
-                                        event = getAnEvent();
-                                        event->clean(EVT_MOUNT);
+                                        event = newEvent(EVT_MOUNT, BUFFER_SIZE);
                                         hasEvent = false;
                                         state = STATE_GET_DRV_NUMBER_TO_MOUNT;
                                         break;
                                         
                                 case PROTO_UNMOUNT:  // unmount a drive
                                         Serial.println("Got an UNMOUNT");
-                                        event = getAnEvent();
-                                        event->clean(EVT_UNMOUNT);
+                                        event = newEvent(EVT_UNMOUNT, SMALL_EVENT_SIZE);
                                         hasEvent = false;
                                         state = STATE_GET_ONE;  // add the drive
                                         break;
@@ -410,8 +845,7 @@ void Link::stateMachine(word token)
                                         // (4) Sector (zero based)
                                         // (5) Number of sectors per track, one based
                                         
-                                        event = getAnEvent();
-                                        event->clean(EVT_READ_SECTOR);
+                                        event = newEvent(EVT_READ_SECTOR, BUFFER_SIZE);
                                         state = STATE_GET_FIVE;
                                         break;
 
@@ -424,11 +858,36 @@ void Link::stateMachine(word token)
                                         // (5) Sector #
                                         // (6) Sector # LSB
                                         
-                                        event = getAnEvent();
-                                        event->clean(EVT_READ_SECTOR_LONG);
+                                        event = newEvent(EVT_READ_SECTOR_LONG, BUFFER_SIZE);
                                         state = STATE_GET_SIX;
                                         break;
                                         
+                                case PROTO_READ_MULTI_LONG:
+                                        // This is followed by seven more bytes:
+                                        // (1) Drive (zero based)
+                                        // (2) Sector size (1 = 128, 2 = 256, 3 = 512, 4 = 1024)
+                                        // (3) First sector # MSB - zero based
+                                        // (4) Sector #
+                                        // (5) Sector #
+                                        // (6) Sector # LSB
+                                        // (7) Number of sectors, 1-255 or 0 for 256
+                                        
+                                        event = newEvent(EVT_READ_MULTI_LONG, BUFFER_SIZE);
+                                        state = STATE_GET_SEVEN;
+                                        break;
+                                        
+                                case PROTO_WRITE_MULTI_LONG:
+                                        // This has the same seven byte header
+                                        // as PROTO_READ_MULTI_LONG, followed by
+                                        // the data for each sector.  The header
+                                        // goes to the main loop first, then
+                                        // each sector as it arrives.  The main
+                                        // loop sends one ACK/NAK at the end.
+                                        
+                                        event = newEvent(EVT_WRITE_MULTI_LONG, SMALL_EVENT_SIZE);
+                                        state = STATE_GET_SEVEN;
+                                        break;
+                                        
                                 case PROTO_WRITE_SECTOR:
                                         // This is followed by five more bytes:
                                         // (1) Drive (zero based)
@@ -439,8 +898,7 @@ void Link::stateMachine(word token)
                                         //
                                         // ...and then the sector data
                                         
-                                        event = getAnEvent();
-                                        event->clean(EVT_WRITE_SECTOR);
+                                        event = newEvent(EVT_WRITE_SECTOR, BUFFER_SIZE);
                                         state = STATE_GET_FIVE;
                                         count = 0;  // no bytes received yet
                                         break;
@@ -456,75 +914,108 @@ void Link::stateMachine(word token)
                                         //
                                         // ...and then the sector data
                                         
-                                        event = getAnEvent();
-                                        event->clean(EVT_WRITE_SECTOR_LONG);
+                                        event = newEvent(EVT_WRITE_SECTOR_LONG, BUFFER_SIZE);
                                         state = STATE_GET_SIX;
                                         count = 0;  // no bytes received yet
                                         break;
 
                                 case PROTO_DONE:    // Also PROTO_ABORT
                                         transactionDone = true;
-                                        event = getAnEvent();
-                                        event->clean(EVT_DONE);
+                                        event = newEvent(EVT_DONE, SMALL_EVENT_SIZE);
+                                        hasEvent = true;
                                         break;
 
                                 case PROTO_GET_STATUS:
-                                        event = getAnEvent();
-                                        event->clean(EVT_GET_STATUS);
+                                        event = newEvent(EVT_GET_STATUS, SMALL_EVENT_SIZE);
                                         state = STATE_GET_ONE;
                                         break;
                                         
                                 case PROTO_GET_VERSION:
-                                        event = getAnEvent();
-                                        event->clean(EVT_GET_VERSION);
+                                        event = newEvent(EVT_GET_VERSION, SMALL_EVENT_SIZE);
                                         hasEvent = true;
                                         break;
 
                                 case PROTO_GET_MOUNTED_LIST:
-                                        event = getAnEvent();
-                                        event->clean(EVT_GET_MOUNTED);
+                                        event = newEvent(EVT_GET_MOUNTED, SMALL_EVENT_SIZE);
                                         hasEvent = true;
                                         break;
 
                                 case PROTO_GET_CLOCK:
-                                        event = getAnEvent();
-                                        event->clean(EVT_GET_CLOCK);
+                                        event = newEvent(EVT_GET_CLOCK, SMALL_EVENT_SIZE);
                                         hasEvent = true;
                                         break;
 
                                 case PROTO_SET_CLOCK:
-                                        event = getAnEvent();
-                                        event->clean(EVT_SET_CLOCK);
+                                        event = newEvent(EVT_SET_CLOCK, SMALL_EVENT_SIZE);
                                         count = 8;
                                         state = STATE_APPEND_SECTOR;
                                         break;
 
                                 case PROTO_WRITE_FILE:
-                                        event = getAnEvent();
-                                        event->clean(EVT_WRITE_FILE);
+                                        event = newEvent(EVT_WRITE_FILE, BUFFER_SIZE);
                                         state = STATE_WAIT_NULL;
                                         hasEvent = false;
                                         break;
 
                                 case PROTO_WRITE_BYTES:
-                                        event = getAnEvent();
-                                        event->clean(EVT_WRITE_BYTES);
+                                        event = newEvent(EVT_WRITE_BYTES, BUFFER_SIZE);
                                         state = STATE_GET_LENGTH;
                                         hasEvent = false;
                                         break;
 
                                 case PROTO_SAVE_CONFIG:
-                                        event = getAnEvent();
-                                        event->clean(EVT_SAVE_CONFIG);
+                                        event = newEvent(EVT_SAVE_CONFIG, SMALL_EVENT_SIZE);
                                         hasEvent = true;
                                         break;
 
                                 case PROTO_SET_TIMER:
-                                        event = getAnEvent();
-                                        event->clean(EVT_SET_TIMER);
+                                        event = newEvent(EVT_SET_TIMER, SMALL_EVENT_SIZE);
                                         state = STATE_GET_ONE;
                                         break;
 
+                                case PROTO_OVERLAY:
+                                        // Drive number, then the action:
+                                        // 0 = discard, 1 = merge.
+                                        
+                                        event = newEvent(EVT_OVERLAY, SMALL_EVENT_SIZE);
+                                        hasEvent = false;
+                                        state = STATE_GET_TWO;
+                                        break;
+
+                                case PROTO_CONVERT:
+                                        // Sector size code and fill value
+                                        // for a new sparse image, then the
+                                        // name of the image to convert.
+                                        
+                                        event = newEvent(EVT_CONVERT, BUFFER_SIZE);
+                                        hasEvent = false;
+                                        state = STATE_GET_DRV_NUMBER_TO_MOUNT;
+                                        break;
+
+                                case PROTO_GET_STATS:
+                                        event = newEvent(EVT_GET_STATS, BUFFER_SIZE);
+                                        hasEvent = true;
+                                        break;
+
+                                case PROTO_SET_HANDSHAKE:
+                                        // One byte, HANDSHAKE_FOUR_PHASE or
+                                        // HANDSHAKE_TOGGLE.
+                                        
+                                        event = newEvent(EVT_SET_HANDSHAKE, SMALL_EVENT_SIZE);
+                                        state = STATE_GET_ONE;
+                                        break;
+
+                                case PROTO_FORMAT:
+                                        // Tracks, sectors per track, fill
+                                        // value and flags, then the name of
+                                        // the new image.
+                                        
+                                        event = newEvent(EVT_FORMAT, BUFFER_SIZE);
+                                        hasEvent = false;
+                                        count = 4;
+                                        state = STATE_GET_PREFIX;
+                                        break;
+
                                 default:
                                         Serial.print("Got unknown command code: ");
                                         Serial.println((byte)token, HEX);
@@ -536,7 +1027,14 @@ void Link::stateMachine(word token)
                         // This keeps adding bytes until a 0x00 is seen, then
                         // it sends the message and returns to the main state.
                         
-                        event->addByte(token);    // always add it, even if null
+                        // Always add it if it's the null.  The last byte of
+                        // room is kept for it, so a name too long for the
+                        // Event is cut short but still ends with one.
+                        
+                        if (token == 0x00 || event->getRoom() > 1)
+                        {
+                                event->addByte(token);
+                        }
                         if (token == 0x00)        // if null, end of the data
                         {
                                 state = STATE_CMD;
@@ -544,6 +1042,11 @@ void Link::stateMachine(word token)
                         }
                         break;
 
+                case STATE_GET_SEVEN:
+                        event->addByte(token);
+                        state = STATE_GET_SIX;
+                        break;
+
                 case STATE_GET_SIX:
                         event->addByte(token);
                         state = STATE_GET_FIVE;
@@ -582,11 +1085,31 @@ void Link::stateMachine(word token)
                         
                         if (event->getType() == EVT_WRITE_SECTOR || event->getType() == EVT_WRITE_SECTOR_LONG)
                         {
-                                // Get the whole sector's worth of data
+                                // Get the whole sector's worth of data.  The
+                                // second byte of the header is the size code.
                                 
-                                count = 256;    // need to calculate from message
+                                count = getSectorSize(event->getData()[1]);
                                 state = STATE_APPEND_SECTOR;
                         }
+                        else if (event->getType() == EVT_WRITE_MULTI_LONG)
+                        {
+                                // Hand the header over now, then collect
+                                // the sectors in the stream buffers.
+                                
+                                streamSectors = (token == 0 ? 256 : token);
+                                streamSize = getSectorSize(event->getData()[1]);
+                                streamFill = 0;
+                                streamEvent[0]->clean(EVT_WRITE_MULTI_DATA);
+                                streamEvent[1]->clean(EVT_WRITE_MULTI_DATA);
+                                count = streamSize;
+                                state = STATE_STREAM_SECTOR;
+                                
+                                // Without a header Event the sectors are
+                                // only counted, and the NAK waits for the
+                                // last of them.
+                                
+                                hasEvent = (event != &discardEvent);
+                        }
                         else
                         {
                                 state = STATE_CMD;
@@ -620,6 +1143,44 @@ void Link::stateMachine(word token)
                         }
                         break;
 
+                case STATE_STREAM_SECTOR:
+                        // Sector data for a streamed write.  Each full sector
+                        // goes to the main loop while the next one is being
+                        // collected in the other buffer.
+                        
+                        if (event == &discardEvent)
+                        {
+                                if (--count == 0 && --streamSectors == 0)
+                                {
+                                        state = STATE_CMD;
+                                        hasEvent = true;
+                                }
+                                else if (count == 0)
+                                {
+                                        count = streamSize;
+                                }
+                                break;
+                        }
+                        
+                        streamEvent[streamFill]->addByte(token);
+                        if (--count == 0)
+                        {
+                                event = streamEvent[streamFill];
+                                hasEvent = true;
+                                streamFill ^= 1;
+                                streamEvent[streamFill]->clean(EVT_WRITE_MULTI_DATA);
+                                
+                                if (--streamSectors == 0)
+                                {
+                                        state = STATE_CMD;
+                                }
+                                else
+                                {
+                                        count = streamSize;
+                                }
+                        }
+                        break;
+
                 case STATE_GET_LENGTH:
                         // This is data for an open write file.  This byte is the length
                         // and is either 1-255 for 1-255 bytes to follow, or 0 to indicate
@@ -630,6 +1191,30 @@ void Link::stateMachine(word token)
                         event->addByte(token);
                         state = STATE_APPEND_SECTOR;
                         break;
+
+                case STATE_GET_PREFIX:
+                        // Fixed bytes ahead of a filename.
+                        
+                        event->addByte(token);
+                        if (--count == 0)
+                        {
+                                state = STATE_WAIT_NULL;
+                        }
+                        break;
+        }
+        
+        // A command taken in without an Event is answered here, once all of
+        // it has arrived, so the host sees the NAK where it expects a reply.
+        
+        if (hasEvent && event == &discardEvent)
+        {
+                prepareWrite();
+                writeByte(PROTO_NAK);
+                writeByte(ERR_NO_MEMORY);
+                prepareRead();
+                event = NULL;
+                hasEvent = false;
+                transactionDone = true;
         }
         
         // If this is the end of a transaction, indicate it on the UI.
@@ -650,10 +1235,163 @@ void Link::stateMachine(word token)
 
 void Link::sendEvent(Event *eptr)
 {
-        byte *bptr;
-        
+        startResponse();
+        sendResponsePart(eptr);
+        endResponse(eptr);
+}
+
+
+
+
+//=============================================================================
+// Some responses are made up of several messages sent back to back, such as
+// the sectors of a multi-sector read.  Call this once before sending the
+// first part with sendResponsePart(), then call endResponse() after the last.
+
+void Link::startResponse(void)
+{
+#ifdef LATENCY_HISTOGRAMS
+        txStart = micros();
+#endif
         prepareWrite();    // get ready to write and for host to read
+}
+
+
+
+
+//=============================================================================
+// Finishes a response started with startResponse().  The bus goes back to the
+// host and the event is freed.
+
+void Link::endResponse(Event *eptr)
+{
+        waitResponsePart();
+        if (nextHandshake != (toggleMode ? HANDSHAKE_TOGGLE : HANDSHAKE_FOUR_PHASE))
+        {
+                changeHandshake();
+        }
+        lastToggle = millis();
+        prepareRead();    // back to read mode
+#ifdef LATENCY_HISTOGRAMS
+        latencyRecord(LAT_TRANSMIT, txStart);
+#endif
+        uInt->sendEvent(UI_TRANSACTION_STOP);
         
+        freeAnEvent(eptr);      // all done with event
+}
+
+
+
+
+//=============================================================================
+// Picks the handshake for everything after the response now being sent, so
+// the reply to PROTO_SET_HANDSHAKE still goes out the old way.  Returns false
+// for a mode that isn't known.
+
+bool Link::setHandshake(byte mode)
+{
+        if (mode != HANDSHAKE_FOUR_PHASE && mode != HANDSHAKE_TOGGLE)
+        {
+                return false;
+        }
+        nextHandshake = mode;
+        return true;
+}
+
+
+
+
+//=============================================================================
+// Switches handshakes between the last byte of a response and reading the
+// next command.  The four phase handshake leaves both lines low, which is a
+// fine place for the toggle one to start.  Going back, the lines may have been
+// left high, so drop ACK and wait for the host to drop STROBE before
+// believing it again.
+
+void Link::changeHandshake(void)
+{
+        if (nextHandshake == HANDSHAKE_TOGGLE)
+        {
+                ackHigh = false;
+                toggleMode = true;
+        }
+        else
+        {
+                toggleMode = false;
+                if (ackHigh)
+                {
+                        LOWER_ACK();
+                        ackHigh = false;
+                        while (STROBE_IS_HIGH())
+                                ;
+                }
+        }
+
+        Serial.print("Link now using the ");
+        Serial.println(toggleMode ? "toggle handshake" : "four phase handshake");
+}
+
+
+
+
+//=============================================================================
+// Goes back to the four phase handshake if the toggle one has been quiet for
+// HANDSHAKE_TIMEOUT between commands, since the host may have rebooted and
+// be using four phase again.  With the lines low that's all it takes.  With
+// them high, ACK drops now and the change is finished once the host has
+// dropped STROBE, without waiting here for it.
+
+void Link::checkHandshakeTimeout(void)
+{
+        if (fallingBack)
+        {
+                if (!STROBE_IS_HIGH())
+                {
+                        fallingBack = false;
+                        toggleMode = false;
+                        Serial.println("Link back to the four phase handshake");
+                }
+                return;
+        }
+        
+        if (!isIdle() || !LINES_EVEN())
+        {
+                lastToggle = millis();
+                return;
+        }
+        if (millis() - lastToggle < HANDSHAKE_TIMEOUT)
+        {
+                return;
+        }
+
+        Serial.println("Toggle handshake timed out");
+        nextHandshake = HANDSHAKE_FOUR_PHASE;
+        if (ackHigh)
+        {
+                fallingBack = true;
+                LOWER_ACK();
+                ackHigh = false;
+        }
+        else
+        {
+                toggleMode = false;
+                Serial.println("Link back to the four phase handshake");
+        }
+}
+
+
+
+
+//=============================================================================
+// Sends one message to the host, reformatted to the line side protocol.  This
+// must be between calls to startResponse() and endResponse().  The event is
+// not freed, so it can be refilled for the next part.
+
+void Link::sendResponsePart(Event *eptr)
+{
+        byte *bptr;
+        
+        waitResponsePart();
         switch (eptr->getType())
         {
                 case EVT_ACK:
@@ -663,11 +1401,17 @@ void Link::sendEvent(Event *eptr)
                 case EVT_NAK:
                         // A NAK is always followed by a single byte
                         // reason code, so send the NAK and then the
-                        // reason byte.
+                        // reason byte.  A few commands add more details
+                        // after the reason, such as which sector of a
+                        // streamed write failed.
                         
                         writeByte(PROTO_NAK);    // NAK
                         bptr = eptr->getData();
-                        writeByte(*bptr);  // reason code
+                        writeByte(*bptr++);  // reason code
+                        for (unsigned i = 1; i < eptr->getLength(); i++)
+                        {
+                                writeByte(*bptr++);
+                        }
                         break;
                         
                 case EVT_FILE_DATA:
@@ -706,7 +1450,8 @@ void Link::sendEvent(Event *eptr)
                         
                 case EVT_READ_SECTOR:
                 {
-                        // Sector data heading back to host.  Always 256 bytes.
+                        // Sector data heading back to host.  The size code
+                        // comes first.
                         
                         writeByte(PROTO_SECTOR_DATA);
                         byte *dptr = eptr->getData();
@@ -740,6 +1485,20 @@ void Link::sendEvent(Event *eptr)
                         break;
                 }
 
+                case EVT_STATS:
+                {
+                        // A length byte, then the block of counters.
+                        
+                        writeByte(PROTO_STATS);
+                        writeByte(eptr->getLength());
+                        byte *dptr = eptr->getData();
+                        for (unsigned i = 0; i < eptr->getLength(); i++)
+                        {
+                                writeByte(*dptr++);
+                        }
+                        break;
+                }
+
                 case EVT_CLOCK_DATA:
                         writeByte(PROTO_CLOCK_DATA);
                         byte *dptr = eptr->getData();
@@ -749,11 +1508,64 @@ void Link::sendEvent(Event *eptr)
                         }
                         break;
         }
-        
-        prepareRead();    // back to read mode
-        uInt->sendEvent(UI_TRANSACTION_STOP);
-        
-        freeAnEvent(eptr);      // all done with event
+}
+
+
+
+
+//=============================================================================
+// Like sendResponsePart(), but with PIPELINED_READS a sector data message is
+// sent by the interrupt and this returns as soon as the first byte is on the
+// bus.  The event must be left alone until waitResponsePart() returns, which
+// is what the next sendResponsePart() or endResponse() does first.  Anything
+// else is just sent.
+
+void Link::queueResponsePart(Event *eptr)
+{
+#ifdef PIPELINED_READS
+        if (eptr->getType() == EVT_READ_SECTOR)
+        {
+                waitResponsePart();
+
+                byte *dptr = eptr->getData();
+                txHeader = PROTO_SECTOR_DATA;
+                txLeft = getSectorSize(*dptr++);
+                txData = dptr;
+
+                noInterrupts();
+                txActive = true;
+                sendNext();
+                interrupts();
+                return;
+        }
+#endif
+        sendResponsePart(eptr);
+}
+
+
+
+
+//=============================================================================
+// Waits for the host to take the whole of a message from queueResponsePart().
+
+void Link::waitResponsePart(void)
+{
+#ifdef PIPELINED_READS
+        while (txActive)
+                ;
+#endif
+}
+
+
+
+
+//=============================================================================
+// A second sector buffer for the main loop's multi-sector reads.  It's one of
+// the streamed write buffers, which are idle while a response is going out.
+
+Event *Link::getSpareEvent(void)
+{
+        return streamEvent[0];
 }
 
 
@@ -761,12 +1573,13 @@ void Link::sendEvent(Event *eptr)
 
 //=============================================================================
 // Rather than constantly freeing and new'ing Events, maintain a set of free
-// ones and just ask for a new one.  This is called to get one, or NULL if
-// none is available.
+// ones and just ask for a new one.  This is called to get one with room for
+// at least need bytes, or NULL if none is available.  Anything that only
+// sends a few bytes should ask for SMALL_EVENT_SIZE.
 
-Event *Link::getAnEvent(void)
+Event *Link::getAnEvent(unsigned need)
 {
-        return freeEvent;
+        return pool.get(need);
 }
 
 
@@ -777,5 +1590,25 @@ Event *Link::getAnEvent(void)
 
 void Link::freeAnEvent(Event *eptr)
 {
-        freeEvent = eptr;
+        pool.put(eptr);
+}
+
+
+
+
+//=============================================================================
+// Gets an Event for a command from the host and sets its type.  If there
+// isn't one free, the command is taken in with the discard Event and NAKed.
+
+Event *Link::newEvent(EVENT_TYPE type, unsigned need)
+{
+        Event *eptr = getAnEvent(need);
+
+        if (eptr == NULL)
+        {
+                Serial.println("No free Event for command");
+                eptr = &discardEvent;
+        }
+        eptr->clean(type);
+        return eptr;
 }
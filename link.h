@@ -14,6 +14,7 @@
 #define __LINK_H__
 
 #include "Event.h"
+#include "EventPool.h"
 #include "UserInt.h"
 
 
@@ -43,6 +44,13 @@
 #define PROTO_SET_TIMER 0x1e
 #define PROTO_READ_SECTOR_LONG 0x1f
 #define PROTO_WRITE_SECTOR_LONG 0x20
+#define PROTO_READ_MULTI_LONG 0x21
+#define PROTO_WRITE_MULTI_LONG 0x22
+#define PROTO_OVERLAY 0x23
+#define PROTO_CONVERT 0x24
+#define PROTO_FORMAT 0x25
+#define PROTO_GET_STATS 0x26
+#define PROTO_SET_HANDSHAKE 0x27
 
 #define PROTO_VERSION  0x81
 #define PROTO_ACK    0x82
@@ -55,6 +63,24 @@
 #define PROTO_STATUS  0x93
 #define PROTO_SECTOR_DATA  0x94
 #define PROTO_MOUNT_INFO  0x95
+#define PROTO_STATS  0x96
+
+// Handshakes for PROTO_SET_HANDSHAKE.  Everything starts with the four phase
+// one; hosts that see a PROTOCOL_VERSION of 2 or more in the reply to
+// PROTO_VERSION can ask for the toggle one.
+//
+// A host that reboots or loses count of the toggles has no way to tell the
+// drive, so the drive goes back to four phase by itself once the link has
+// been quiet for HANDSHAKE_TIMEOUT milliseconds between commands.  If it left
+// the lines high it drops ACK, and expects the host to drop STROBE before the
+// next command.  So a host using the toggle handshake that is quiet for that
+// long starts again with four phase, and sends PROTO_SET_HANDSHAKE again if
+// it wants toggles.  One that has been quiet for less, but can't be sure of
+// how long, waits out the rest of the timeout and does the same.
+
+#define HANDSHAKE_FOUR_PHASE  0
+#define HANDSHAKE_TOGGLE  1
+#define HANDSHAKE_TIMEOUT  1000
 
 
 
@@ -71,18 +97,33 @@ class Link
                 void writeByte(byte data);
                 byte readByte(void);
                 bool waitingEvent(void) { return hasEvent; }
+                bool isIdle(void);
                 Event *getEvent(void);
                 void sendEvent(Event *ep);
-                Event *getAnEvent(void);
+                void startResponse(void);
+                void sendResponsePart(Event *ep);
+                void endResponse(Event *ep);
+                void queueResponsePart(Event *ep);
+                void waitResponsePart(void);
+                Event *getSpareEvent(void);
+                Event *getAnEvent(unsigned need = BUFFER_SIZE);
                 void freeAnEvent(Event *eptr);
+                void showEventStats(void) { pool.showStats(); }
+                bool setHandshake(byte mode);
                      
         private:
                 bool hasEvent;
+                byte nextHandshake;     // takes effect after this response
+                unsigned long lastToggle;       // when the toggle handshake last moved a byte
+                void changeHandshake(void);
+                void checkHandshakeTimeout(void);
                 byte assembleByte(void);
                 void disassembleByte(byte raw);
                 void stateMachine(word token);
+                Event *newEvent(EVENT_TYPE type, unsigned need);
                 Event *event;
-                Event *freeEvent;
+                EventPool pool;
+                Event *streamEvent[2];  // double buffer for streamed writes
                 UserInt *uInt;
 };
 